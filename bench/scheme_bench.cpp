@@ -0,0 +1,270 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "../src/jit.h"
+#include "../src/parser.h"
+#include "../src/scheme.h"
+#include "../src/tokenizer.h"
+
+// Runs classic interpreter workloads and prints the timings as JSON:
+//
+//   scheme_bench [--repetitions N] [--no-jit] [--verify] [filter]
+//
+// Only benchmarks whose name contains filter are run. Every benchmark gets a fresh
+// Interpreter; its setup and one warm-up run of the body are not timed. --no-jit keeps hot
+// lambdas interpreted, --verify also runs every benchmark without the JIT and fails if the
+// results differ.
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Benchmark {
+    std::string name;
+    std::vector<std::string> setup;
+    std::function<std::string(Interpreter&)> body;
+};
+
+struct Result {
+    std::string name;
+    std::string value;
+    std::vector<double> seconds;
+};
+
+Benchmark SchemeBenchmark(const std::string& name, std::vector<std::string> setup,
+                          const std::string& expr) {
+    return {name, std::move(setup), [expr](Interpreter& inter) { return inter.Run(expr); }};
+}
+
+const std::vector<std::string> kListLibrary = {
+    "(define (build n acc) (if (= n 0) acc (build (- n 1) (cons n acc))))",
+    "(define (rev l acc) (if (null? l) acc (rev (cdr l) (cons (car l) acc))))",
+    "(define (len l) (if (null? l) 0 (+ 1 (len (cdr l)))))",
+    "(define (app a b) (if (null? a) b (cons (car a) (app (cdr a) b))))",
+};
+
+std::vector<std::string> WithLists(std::vector<std::string> setup) {
+    setup.insert(setup.begin(), kListLibrary.begin(), kListLibrary.end());
+    return setup;
+}
+
+// Nested lists of numbers and symbols, roughly size bytes long.
+std::string GenerateSource(size_t size) {
+    std::mt19937 gen(42);
+    std::string res;
+    int depth = 0;
+    while (res.size() < size || depth > 0) {
+        auto kind = gen() % 6;
+        if (kind == 0 && depth < 16 && res.size() < size) {
+            res += "(";
+            ++depth;
+        } else if (kind == 1 && depth > 0) {
+            res += ") ";
+            --depth;
+        } else if (kind % 2 == 0) {
+            res += std::to_string(static_cast<int>(gen() % 100000) - 50000) + " ";
+        } else {
+            res += "sym" + std::to_string(gen() % 1000) + " ";
+        }
+        if (depth == 0 && res.size() < size) {
+            res += "(";
+            ++depth;
+        }
+    }
+    return res;
+}
+
+std::vector<Benchmark> MakeBenchmarks() {
+    std::vector<Benchmark> res;
+
+    res.push_back(SchemeBenchmark(
+        "fib", {"(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"}, "(fib 20)"));
+
+    res.push_back(SchemeBenchmark("tak",
+                                  {"(define (tak x y z) (if (not (< y x)) z"
+                                   " (tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y))))"},
+                                  "(tak 12 8 4)"));
+
+    res.push_back(SchemeBenchmark(
+        "nqueens",
+        WithLists({"(define (ok? row dist placed) (if (null? placed) #t"
+                   " (and (not (= (car placed) (+ row dist))) (not (= (car placed) (- row dist)))"
+                   " (ok? row (+ dist 1) (cdr placed)))))",
+                   "(define (try-it x y z) (if (null? x) (if (null? y) 1 0)"
+                   " (+ (if (ok? (car x) 1 z) (try-it (app (cdr x) y) '() (cons (car x) z)) 0)"
+                   " (try-it (cdr x) (cons (car x) y) z))))",
+                   "(define (queens n) (try-it (rev (build n '()) '()) '() '()))"}),
+        "(queens 7)"));
+
+    res.push_back(SchemeBenchmark(
+        "ackermann",
+        {"(define (ack m n) (if (= m 0) (+ n 1)"
+         " (if (= n 0) (ack (- m 1) 1) (ack (- m 1) (ack m (- n 1))))))"},
+        "(ack 3 5)"));
+
+    res.push_back(SchemeBenchmark("list-build-reverse", WithLists({}),
+                                  "(len (rev (build 10000 '()) '()))"));
+
+    res.push_back(SchemeBenchmark(
+        "list-library", WithLists({"(define data (rev (build 20000 '()) '()))"}),
+        "(length (sort (filter (lambda (n) (< (- n (* 3 (/ n 3))) 2))"
+        " (map (lambda (n) (- 20000 n)) (reverse (append data data)))) <))"));
+
+    res.push_back(SchemeBenchmark(
+        "loops", {},
+        "(+ (let loop ((i 0) (acc 0)) (if (= i 100000) acc (loop (+ i 1) (+ acc i))))"
+        " (do ((i 0 (+ i 1)) (acc 0 (+ acc i))) ((= i 100000) acc)))"));
+
+    // The uses of my-or inside cond are expanded by their first evaluation.
+    res.push_back(SchemeBenchmark(
+        "macros",
+        {"(define-syntax my-or (syntax-rules () ((_) #f) ((_ e) e)"
+         " ((_ e r ...) (let ((t e)) (if t t (my-or r ...))))))",
+         "(define (count-odd n) (let loop ((i 0) (acc 0)) (cond ((= i n) acc)"
+         " (else (loop (+ i 1) (my-or (and (= (- i (* 2 (/ i 2))) 1) (+ acc 1)) acc))))))"},
+        "(count-odd 20000)"));
+
+    // Every callback is created next to a list it does not refer to.
+    res.push_back(SchemeBenchmark(
+        "closures",
+        WithLists({"(define (adders n acc) (if (= n 0) acc (adders (- n 1)"
+                   " (cons (let ((junk (build 100 '()))) (lambda (x) (+ x n))) acc))))"}),
+        "(fold-left (lambda (sum f) (f sum)) 0 (adders 2000 '()))"));
+
+    res.push_back(SchemeBenchmark(
+        "deep-recursion", {"(define (down n) (if (= n 0) 0 (+ 1 (down (- n 1)))))"},
+        "(down 10000)"));
+
+    res.push_back(SchemeBenchmark(
+        "par-map", WithLists({"(define work (build 32 '()))"}),
+        "(par-reduce + 0 (par-map (lambda (n) (len (rev (build 2000 '()) '()))) work))"));
+
+    auto source = std::make_shared<std::string>(GenerateSource(1 << 20));
+    res.push_back({"reader", {}, [source](Interpreter&) {
+                       std::stringstream stream(*source);
+                       Tokenizer tokenizer(&stream);
+                       size_t forms = 0;
+                       while (!tokenizer.IsEnd()) {
+                           Read(&tokenizer);
+                           ++forms;
+                       }
+                       return std::to_string(forms);
+                   }});
+
+    // 100 lists of 5000 numbers stay alive while every Run collects garbage.
+    res.push_back(
+        {"gc-large-live-set",
+         WithLists({"(define (fill n acc) (if (= n 0) acc (fill (- n 1) (cons (build 5000 '()) acc))))",
+                    "(define live (fill 100 '()))"}),
+         [](Interpreter& inter) {
+             std::string last;
+             for (int i = 0; i < 20; ++i) {
+                 last = inter.Run("(len (build 1000 '()))");
+             }
+             return last;
+         }});
+
+    res.push_back({"print-big-list", WithLists({"(define big (build 20000 '()))"}),
+                   [](Interpreter& inter) { return std::to_string(inter.Run("big").size()); }});
+
+    return res;
+}
+
+Result RunBenchmark(const Benchmark& benchmark, int repetitions) {
+    Result res{benchmark.name, {}, {}};
+    Interpreter inter;
+    for (auto& line : benchmark.setup) {
+        inter.Run(line);
+    }
+    benchmark.body(inter);
+    for (int i = 0; i < repetitions; ++i) {
+        auto start = Clock::now();
+        res.value = benchmark.body(inter);
+        res.seconds.push_back(std::chrono::duration<double>(Clock::now() - start).count());
+    }
+    return res;
+}
+
+std::string Escape(const std::string& str) {
+    std::string res;
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            res += '\\';
+        }
+        res += c;
+    }
+    return res;
+}
+
+void PrintJson(const std::vector<Result>& results) {
+    std::cout << "{\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        auto seconds = results[i].seconds;
+        std::sort(seconds.begin(), seconds.end());
+        double total = 0;
+        for (auto s : seconds) {
+            total += s;
+        }
+        std::cout << (i == 0 ? "\n" : ",\n") << "    {\"name\": \"" << Escape(results[i].name)
+                  << "\", \"result\": \"" << Escape(results[i].value)
+                  << "\", \"repetitions\": " << seconds.size()
+                  << ", \"min_seconds\": " << seconds.front()
+                  << ", \"median_seconds\": " << seconds[seconds.size() / 2]
+                  << ", \"mean_seconds\": " << total / seconds.size()
+                  << ", \"max_seconds\": " << seconds.back() << "}";
+    }
+    std::cout << "\n  ]\n}" << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    int repetitions = 5;
+    bool verify = false;
+    std::string filter;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--repetitions" && i + 1 < argc) {
+            repetitions = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--no-jit") {
+            Jit::SetEnabled(false);
+        } else if (arg == "--verify") {
+            verify = true;
+        } else {
+            filter = arg;
+        }
+    }
+
+    std::vector<Result> results;
+    for (auto& benchmark : MakeBenchmarks()) {
+        if (benchmark.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        try {
+            results.push_back(RunBenchmark(benchmark, repetitions));
+            if (verify) {
+                auto jit = Jit::IsEnabled();
+                Jit::SetEnabled(false);
+                auto expected = RunBenchmark(benchmark, 1).value;
+                Jit::SetEnabled(jit);
+                if (expected != results.back().value) {
+                    std::cerr << benchmark.name << ": got " << results.back().value
+                              << ", the interpreter gives " << expected << std::endl;
+                    return 1;
+                }
+            }
+        } catch (std::exception& e) {
+            std::cerr << benchmark.name << " failed: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+    PrintJson(results);
+    return 0;
+}
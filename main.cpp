@@ -1,11 +1,102 @@
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
 #include <string>
+#include <vector>
 #include "src/error.h"
+#include "src/jit.h"
+#include "src/profiler.h"
 #include "src/scheme.h"
 
-int main() {
+// SCHEME_PROFILE=exact or SCHEME_PROFILE=sampling profiles the session. The report is printed
+// to stderr on exit, folded stacks are written to SCHEME_PROFILE_FOLDED if it is set.
+void StartProfiler() {
+    const char* mode = std::getenv("SCHEME_PROFILE");
+    if (mode == nullptr) {
+        return;
+    }
+    if (std::string(mode) == "sampling") {
+        Profiler::Instance()->Start(ProfilerMode::SAMPLING);
+    } else {
+        Profiler::Instance()->Start(ProfilerMode::EXACT);
+    }
+}
+
+void StopProfiler() {
+    if (!Profiler::IsEnabled()) {
+        return;
+    }
+    Profiler::Instance()->Stop();
+    Profiler::Instance()->WriteReport(std::cerr);
+    if (const char* path = std::getenv("SCHEME_PROFILE_FOLDED")) {
+        std::ofstream out(path);
+        Profiler::Instance()->WriteFolded(out);
+    }
+}
+
+EvalLimits LimitsFromEnvironment() {
+    EvalLimits limits;
+    if (const char* steps = std::getenv("SCHEME_MAX_STEPS")) {
+        limits.max_steps = std::strtoull(steps, nullptr, 10);
+    }
+    if (const char* bytes = std::getenv("SCHEME_MAX_ALLOCATED_BYTES")) {
+        limits.max_allocated_bytes = std::strtoull(bytes, nullptr, 10);
+    }
+    if (const char* timeout = std::getenv("SCHEME_TIMEOUT_MS")) {
+        limits.timeout = std::chrono::milliseconds(std::strtoll(timeout, nullptr, 10));
+    }
+    return limits;
+}
+
+// main [--load-image path] [--load file]... [--save-image path]
+//
+// --load-image starts from the bindings of an image instead of an empty environment,
+// --save-image writes the environment to an image once the input ends. Together they let a
+// prelude be evaluated once: main --save-image prelude.img < prelude.scm.
+// --load evaluates a source file before reading the input; parsed files are cached in
+// SCHEME_CACHE_DIR if it is set. SCHEME_JIT=0 keeps hot lambdas interpreted.
+// SCHEME_MAX_STEPS, SCHEME_MAX_ALLOCATED_BYTES and SCHEME_TIMEOUT_MS limit every line and file.
+int main(int argc, char** argv) {
     std::string s;
+    std::string load_image, save_image;
+    std::vector<std::string> load_files;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i];
+        if (arg == "--load-image") {
+            load_image = argv[i + 1];
+        } else if (arg == "--save-image") {
+            save_image = argv[i + 1];
+        } else if (arg == "--load") {
+            load_files.push_back(argv[i + 1]);
+        }
+    }
+
     Interpreter inter;
+    if (!load_image.empty()) {
+        try {
+            inter.LoadImage(load_image);
+        } catch (RuntimeError& e) {
+            std::cerr << "Can not load image: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+    if (const char* jit = std::getenv("SCHEME_JIT")) {
+        Jit::SetEnabled(std::string(jit) != "0");
+    }
+    if (const char* cache_directory = std::getenv("SCHEME_CACHE_DIR")) {
+        inter.SetCacheDirectory(cache_directory);
+    }
+    inter.SetLimits(LimitsFromEnvironment());
+    StartProfiler();
+    for (auto& file : load_files) {
+        try {
+            inter.LoadFile(file);
+        } catch (std::runtime_error& e) {
+            std::cerr << "Can not load " << file << ": " << e.what() << std::endl;
+            return 1;
+        }
+    }
     while (std::getline(std::cin, s)) {
         try {
             std::cout << inter.Run(s) << std::endl;
@@ -15,6 +106,17 @@ int main() {
             std::cout << "Name error: " << e.what() << std::endl;
         } catch (RuntimeError& e) {
             std::cout << "Runtime error: " << e.what() << std::endl;
+        } catch (LimitError& e) {
+            std::cout << "Limit error: " << e.what() << std::endl;
+        }
+    }
+    StopProfiler();
+    if (!save_image.empty()) {
+        try {
+            inter.SaveImage(save_image);
+        } catch (RuntimeError& e) {
+            std::cerr << "Can not save image: " << e.what() << std::endl;
+            return 1;
         }
     }
     return 0;
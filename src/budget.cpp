@@ -0,0 +1,61 @@
+#include "budget.h"
+
+#include <algorithm>
+#include "error.h"
+#include "object.h"
+
+void Budget::Start(const EvalLimits& limits, const CancellationToken* token) {
+    countdown_ = 0;
+    token_ = token;
+    remaining_ = limits.max_steps == 0 ? INT64_MAX : static_cast<int64_t>(limits.max_steps);
+    exceeded_ = NONE;
+    max_allocated_bytes_ = limits.max_allocated_bytes;
+    allocated_at_start_ = Heap::Instance()->GetStats().bytes_allocated;
+    has_deadline_ = limits.timeout.count() > 0;
+    deadline_ = std::chrono::steady_clock::now() + limits.timeout;
+}
+
+void Budget::Check() {
+    if (Refill()) {
+        return;
+    }
+    switch (exceeded_.load(std::memory_order_relaxed)) {
+        case STEPS:
+            throw LimitError("Step limit exceeded");
+        case ALLOCATION:
+            throw LimitError("Allocation limit exceeded");
+        case CANCELLED:
+            throw CancelledError("Evaluation cancelled");
+        default:
+            throw LimitError("Deadline exceeded");
+    }
+}
+
+// The step that ran the countdown out is the first one of the new steps.
+bool Budget::Refill() noexcept {
+    if (exceeded_.load(std::memory_order_relaxed) == NONE) {
+        auto left = remaining_.fetch_sub(kInterval, std::memory_order_relaxed);
+        if (token_ != nullptr && token_->IsCancelled()) {
+            Exceed(CANCELLED);
+        } else if (left <= 0) {
+            Exceed(STEPS);
+        } else if (has_deadline_ && std::chrono::steady_clock::now() >= deadline_) {
+            Exceed(DEADLINE);
+        } else if (max_allocated_bytes_ != 0 && !Heap::InTask() &&
+                   Heap::Instance()->GetStats().bytes_allocated - allocated_at_start_ >
+                       max_allocated_bytes_) {
+            Exceed(ALLOCATION);
+        } else {
+            countdown_ = std::min(left, kInterval);
+            return true;
+        }
+    }
+    countdown_ = 0;
+    return false;
+}
+
+// The first limit exceeded is the one reported.
+void Budget::Exceed(Reason reason) {
+    int expected = NONE;
+    exceeded_.compare_exchange_strong(expected, reason, std::memory_order_relaxed);
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Limits of one Interpreter::Run or LoadFile; zero means no limit.
+struct EvalLimits {
+    uint64_t max_steps = 0;
+    // Bytes the run may allocate, counted like HeapStats::bytes_allocated. What the run frees
+    // again still counts, what earlier runs left on the heap does not.
+    uint64_t max_allocated_bytes = 0;
+    std::chrono::milliseconds timeout{0};
+};
+
+// Stops the evaluations it is set for (see Interpreter::SetCancellationToken) at their next
+// safepoints. Cancel may be called from any thread; the token stays cancelled until Reset.
+class CancellationToken {
+public:
+    void Cancel() {
+        cancelled_.store(true, std::memory_order_relaxed);
+    }
+
+    void Reset() {
+        cancelled_.store(false, std::memory_order_relaxed);
+    }
+
+    bool IsCancelled() const {
+        return cancelled_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<bool> cancelled_ = false;
+};
+
+// Enforces EvalLimits and cancellation for the runs of one Interpreter, whose evaluation
+// reaches it through NameSpace::GetBudget. Every call of a lambda, compiled ones included,
+// every iteration of a loop and every macro expansion is a step. Steps are safepoints that only
+// decrement a thread-local countdown; when it runs out, Check takes up to kInterval more steps
+// from the count of the budget and looks at the cancellation token, the clock and, on the main
+// thread, the allocated bytes. So cancellation and the deadline take effect within kInterval
+// steps, and what primitives allocate between two safepoints is only noticed at the next one.
+class Budget {
+public:
+    static constexpr int64_t kInterval = 1024;
+
+    // Starts counting from zero under limits, stopping once token is cancelled. The token has
+    // to outlive the evaluation.
+    void Start(const EvalLimits& limits, const CancellationToken* token = nullptr);
+
+    // Lifts the limits.
+    void Stop() {
+        Start({});
+    }
+
+    void Step() {
+        if (--countdown_ <= 0) {
+            Check();
+        }
+    }
+
+    // Refills the countdown or throws LimitError, or CancelledError once the token is
+    // cancelled. After that every safepoint throws until the next Start, so parallel tasks
+    // unwind as well.
+    void Check();
+
+    // Like Check, but returns false instead of throwing, for compiled code.
+    bool Refill() noexcept;
+
+    static int64_t GetCountdown() {
+        return countdown_;
+    }
+
+    static void SetCountdown(int64_t countdown) {
+        countdown_ = countdown;
+    }
+
+private:
+    enum Reason : int { NONE, STEPS, ALLOCATION, DEADLINE, CANCELLED };
+
+    void Exceed(Reason reason);
+
+    // Steps a thread may take before asking a budget again; Start resets it.
+    static inline thread_local int64_t countdown_ = 0;
+
+    std::atomic<int64_t> remaining_ = INT64_MAX;
+    std::atomic<int> exceeded_ = NONE;
+
+    // Only changed by Start, while no task is running.
+    const CancellationToken* token_ = nullptr;
+    uint64_t max_allocated_bytes_ = 0;
+    uint64_t allocated_at_start_ = 0;
+    bool has_deadline_ = false;
+    std::chrono::steady_clock::time_point deadline_;
+};
@@ -0,0 +1,75 @@
+#include "code_cache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <unistd.h>
+#include "error.h"
+#include "image.h"
+
+namespace {
+
+uint64_t HashSource(const std::string& source) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : source) {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+}  // namespace
+
+std::string CodeCache::GetPath(const std::string& source) const {
+    char name[40];
+    std::snprintf(name, sizeof(name), "%016llx-v%u.mkc",
+                  static_cast<unsigned long long>(HashSource(source)), kVersion);
+    return (std::filesystem::path(directory_) / name).string();
+}
+
+// An entry starts with the length of the source and the source itself, which is compared in
+// full: the hash only picks the file.
+std::optional<std::vector<Object*>> CodeCache::Load(const std::string& source,
+                                                    NameSpace* global) {
+    std::ifstream in(GetPath(source), std::ios::binary);
+    if (!in) {
+        return std::nullopt;
+    }
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    uint64_t size;
+    if (data.size() < sizeof(size)) {
+        return std::nullopt;
+    }
+    std::memcpy(&size, data.data(), sizeof(size));
+    if (size != source.size() || data.size() - sizeof(size) < size ||
+        data.compare(sizeof(size), size, source) != 0) {
+        return std::nullopt;
+    }
+    try {
+        return DecodeImage(std::string_view(data).substr(sizeof(size) + size), global);
+    } catch (RuntimeError&) {
+        return std::nullopt;
+    }
+}
+
+void CodeCache::Store(const std::string& source, const std::vector<Object*>& forms) {
+    auto path = GetPath(source);
+    // Concurrent writers of the same entry each use their own temporary file.
+    auto tmp = path + "." + std::to_string(getpid()) + ".tmp";
+    std::error_code error;
+    std::filesystem::create_directories(directory_, error);
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        uint64_t size = source.size();
+        out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+        out.write(source.data(), source.size());
+        auto data = EncodeImage(forms);
+        out.write(data.data(), data.size());
+        if (!out) {
+            std::filesystem::remove(tmp, error);
+            return;
+        }
+    }
+    std::filesystem::rename(tmp, path, error);
+}
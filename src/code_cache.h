@@ -0,0 +1,29 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <vector>
+#include "object.h"
+
+// On-disk cache of parsed source files. Entries are keyed by a hash of the source text and
+// the cache version and hold the source followed by its forms in the image format, so a hit
+// skips the tokenizer and the reader. Entries that can not be read or were made of another
+// source are ignored.
+class CodeCache {
+public:
+    // Bumped whenever the reader or the image format changes what a source parses to.
+    static constexpr uint32_t kVersion = 2;
+
+    explicit CodeCache(std::string directory) : directory_(std::move(directory)) {
+    }
+
+    std::optional<std::vector<Object*>> Load(const std::string& source, NameSpace* global);
+
+    // Failures to write are ignored, the cache is only an optimization.
+    void Store(const std::string& source, const std::vector<Object*>& forms);
+
+private:
+    std::string GetPath(const std::string& source) const;
+
+    std::string directory_;
+};
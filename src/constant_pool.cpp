@@ -0,0 +1,62 @@
+#include "constant_pool.h"
+
+bool ConstantPool::IsInternable(Object* obj) {
+    while (Is<Cell>(obj) && !obj->IsConstant()) {
+        if (!IsInternable(As<Cell>(obj)->GetFirst())) {
+            return false;
+        }
+        obj = As<Cell>(obj)->GetSecond();
+    }
+    return obj == nullptr || obj->IsConstant() || Is<Number>(obj) || Is<Boolean>(obj) ||
+           Is<Symbol>(obj) || Is<Cell>(obj);
+}
+
+// Lists are interned from the last pair back, so long lists do not recurse along the spine.
+Object* ConstantPool::Intern(Object* obj) {
+    if (obj == nullptr || obj->IsConstant() || !IsInternable(obj)) {
+        return obj;
+    }
+    std::lock_guard lock(mutex_);
+    std::vector<Cell*> spine;
+    while (Is<Cell>(obj) && !obj->IsConstant()) {
+        spine.push_back(As<Cell>(obj));
+        obj = spine.back()->GetSecond();
+    }
+    Object* res = InternAtom(obj);
+    for (auto it = spine.rbegin(); it != spine.rend(); ++it) {
+        auto first = (*it)->GetFirst();
+        first = Is<Cell>(first) ? Intern(first) : InternAtom(first);
+        auto [entry, inserted] = cells_.try_emplace({first, res}, nullptr);
+        if (inserted) {
+            entry->second = Add<Cell>(first, res);
+        }
+        res = entry->second;
+    }
+    return res;
+}
+
+Object* ConstantPool::InternAtom(Object* obj) {
+    if (obj == nullptr || obj->IsConstant() || Is<Boolean>(obj)) {
+        return obj;
+    }
+    if (Is<Number>(obj)) {
+        auto value = As<Number>(obj)->GetValue();
+        auto [entry, inserted] = numbers_.try_emplace(value, nullptr);
+        if (inserted) {
+            entry->second = Add<Number>(value);
+        }
+        return entry->second;
+    }
+    auto& name = As<Symbol>(obj)->GetName();
+    auto [entry, inserted] = symbols_.try_emplace(name, nullptr);
+    if (inserted) {
+        entry->second = Add<Symbol>(name);
+    }
+    return entry->second;
+}
+
+template <typename T, typename... Args>
+Object* ConstantPool::Add(Args&&... args) {
+    objects_.push_back(Heap::Instance()->MakeConstant<T>(std::forward<Args>(args)...));
+    return objects_.back().get();
+}
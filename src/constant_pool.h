@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "object.h"
+
+// Quoted data. Constants are hash-consed, so equal numbers, symbols and lists are one object
+// however often they are quoted. They live outside of the heap, are never copied and can not be
+// modified. Every interpreter has its own pool, which frees the constants along with the
+// interpreter; a namespace reaches it through NameSpace::GetConstants.
+class ConstantPool {
+public:
+    // Returns the constant equal to obj. Data with anything but numbers, booleans, symbols and
+    // pairs in it is returned as it is.
+    Object* Intern(Object* obj);
+
+private:
+    struct PairHash {
+        size_t operator()(const std::pair<Object*, Object*>& pair) const {
+            auto first = std::hash<Object*>()(pair.first);
+            return first ^ (std::hash<Object*>()(pair.second) + 0x9e3779b97f4a7c15 +
+                            (first << 6) + (first >> 2));
+        }
+    };
+
+    static bool IsInternable(Object* obj);
+
+    Object* InternAtom(Object* obj);
+
+    template <typename T, typename... Args>
+    Object* Add(Args&&... args);
+
+    std::recursive_mutex mutex_;
+    std::unordered_map<int64_t, Object*> numbers_;
+    std::unordered_map<std::string, Object*> symbols_;
+    std::unordered_map<std::pair<Object*, Object*>, Object*, PairHash> cells_;
+    std::vector<std::unique_ptr<Object>> objects_;
+};
@@ -13,3 +13,13 @@ struct RuntimeError : public std::runtime_error {
 struct NameError : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
+
+// An evaluation went over one of the limits set with Interpreter::SetLimits.
+struct LimitError : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+// An evaluation was stopped through its CancellationToken.
+struct CancelledError : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
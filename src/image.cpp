@@ -0,0 +1,694 @@
+#include "image.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include "error.h"
+#include "scheme.h"
+
+namespace {
+
+// Layout: magic, version, object count, the objects as tagged records and then the roots.
+// Integers are little-endian as in memory, strings are a u32 length followed by the bytes.
+// A reference is a u32: 0 is the empty list, 1 and 2 are #f and #t, n > 2 is object n - 3.
+
+constexpr char kMagic[8] = {'M', 'K', 'S', 'C', 'H', 'I', 'M', 'G'};
+constexpr uint32_t kVersion = 2;
+constexpr uint32_t kFirstObject = 3;
+
+enum class Tag : uint8_t {
+    NUMBER,
+    SYMBOL,
+    CELL,
+    NAMESPACE,
+    LAMBDA,
+    FOLDED_FORM,
+    MEMOIZED,
+    PRIMITIVE,
+    PROMISE,
+    MACRO,
+    BOX,
+    ALIAS,
+};
+
+bool IsPrimitive(Object* obj) {
+    return Is<Functor>(obj) && !Is<Lambda>(obj) && !Is<Memoized>(obj);
+}
+
+class ImageWriter {
+public:
+    std::string Encode(std::span<Object* const> roots) {
+        for (auto root : roots) {
+            Visit(root);
+        }
+        while (!pending_.empty()) {
+            auto obj = pending_.back();
+            pending_.pop_back();
+            VisitChildren(obj);
+        }
+
+        out_.append(kMagic, sizeof(kMagic));
+        WriteU32(kVersion);
+        WriteU32(objects_.size());
+        for (auto obj : objects_) {
+            WriteRecord(obj);
+        }
+        WriteU32(roots.size());
+        for (auto root : roots) {
+            WriteRef(root);
+        }
+        return std::move(out_);
+    }
+
+private:
+    void Visit(Object* obj) {
+        if (obj == nullptr || Is<Boolean>(obj) || index_.contains(obj)) {
+            return;
+        }
+        // Parents go first, so the reader can create every namespace with its parent.
+        if (Is<NameSpace>(obj)) {
+            Visit(As<NameSpace>(obj)->GetUpper());
+        }
+        index_.emplace(obj, objects_.size());
+        objects_.push_back(obj);
+        pending_.push_back(obj);
+    }
+
+    void VisitChildren(Object* obj) {
+        if (Is<Number>(obj)) {
+            return;
+        } else if (Is<Symbol>(obj)) {
+            Visit(As<Symbol>(obj)->GetOriginal());
+            Visit(As<Symbol>(obj)->GetScope());
+        } else if (Is<Cell>(obj)) {
+            Visit(As<Cell>(obj)->GetFirst());
+            Visit(As<Cell>(obj)->GetSecond());
+        } else if (Is<NameSpace>(obj)) {
+            auto ns = As<NameSpace>(obj);
+            for (auto& [name, value] : ns->GetBindings()) {
+                slots_.emplace(&value, std::make_pair(ns, name));
+                Visit(value);
+            }
+        } else if (Is<Lambda>(obj)) {
+            auto lambda = As<Lambda>(obj);
+            for (auto arg : lambda->GetArgNames()) {
+                Visit(arg);
+            }
+            for (auto form : lambda->GetBody()) {
+                Visit(form);
+            }
+            Visit(lambda->GetScope());
+        } else if (Is<FoldedForm>(obj)) {
+            auto folded = As<FoldedForm>(obj);
+            Visit(folded->GetFolded());
+            Visit(folded->GetOriginal());
+            for (auto [cell, value] : folded->GetDependencies()) {
+                Visit(value);
+            }
+        } else if (Is<Memoized>(obj)) {
+            Visit(As<Memoized>(obj)->GetFunction());
+        } else if (Is<Promise>(obj)) {
+            auto promise = As<Promise>(obj);
+            Visit(promise->GetExpression());
+            Visit(promise->GetScope());
+            Visit(promise->GetValue());
+        } else if (Is<Macro>(obj)) {
+            auto macro = As<Macro>(obj);
+            for (auto objs : {&macro->GetLiterals(), &macro->GetRules()}) {
+                for (auto elem : *objs) {
+                    Visit(elem);
+                }
+            }
+            Visit(macro->GetScope());
+        } else if (Is<Box>(obj)) {
+            Visit(As<Box>(obj)->GetValue());
+        } else if (!IsPrimitive(obj)) {
+            throw RuntimeError("Object can not be saved to an image");
+        }
+    }
+
+    void WriteRecord(Object* obj) {
+        if (Is<Number>(obj)) {
+            WriteTag(Tag::NUMBER);
+            WriteI64(As<Number>(obj)->GetValue());
+        } else if (Is<Symbol>(obj) && As<Symbol>(obj)->GetOriginal() != nullptr) {
+            auto symbol = As<Symbol>(obj);
+            WriteTag(Tag::ALIAS);
+            WriteString(symbol->GetName());
+            WriteRef(symbol->GetOriginal());
+            WriteRef(symbol->GetScope());
+        } else if (Is<Symbol>(obj)) {
+            WriteTag(Tag::SYMBOL);
+            WriteString(As<Symbol>(obj)->GetName());
+        } else if (Is<Cell>(obj)) {
+            WriteTag(Tag::CELL);
+            WriteRef(As<Cell>(obj)->GetFirst());
+            WriteRef(As<Cell>(obj)->GetSecond());
+        } else if (Is<NameSpace>(obj)) {
+            auto ns = As<NameSpace>(obj);
+            WriteTag(Tag::NAMESPACE);
+            WriteRef(ns->GetUpper());
+            WriteU32(ns->GetBindings().size());
+            for (auto& [name, value] : ns->GetBindings()) {
+                WriteString(name);
+                WriteRef(value);
+            }
+        } else if (Is<Lambda>(obj)) {
+            auto lambda = As<Lambda>(obj);
+            WriteTag(Tag::LAMBDA);
+            WriteString(lambda->GetName());
+            WriteRefs(lambda->GetArgNames());
+            WriteRefs(lambda->GetBody());
+            WriteRef(lambda->GetScope());
+        } else if (Is<FoldedForm>(obj)) {
+            WriteFoldedForm(As<FoldedForm>(obj));
+        } else if (Is<Memoized>(obj)) {
+            WriteTag(Tag::MEMOIZED);
+            WriteRef(As<Memoized>(obj)->GetFunction());
+            WriteU64(As<Memoized>(obj)->GetCapacity());
+        } else if (Is<Promise>(obj)) {
+            auto promise = As<Promise>(obj);
+            WriteTag(Tag::PROMISE);
+            WriteRaw<uint8_t>(promise->IsForced());
+            WriteRef(promise->GetExpression());
+            WriteRef(promise->GetScope());
+            WriteRef(promise->GetValue());
+        } else if (Is<Macro>(obj)) {
+            auto macro = As<Macro>(obj);
+            WriteTag(Tag::MACRO);
+            WriteString(macro->GetName());
+            WriteRefs(macro->GetLiterals());
+            WriteRefs(macro->GetRules());
+            WriteRef(macro->GetScope());
+        } else if (Is<Box>(obj)) {
+            WriteTag(Tag::BOX);
+            WriteRef(As<Box>(obj)->GetValue());
+        } else {
+            WriteTag(Tag::PRIMITIVE);
+            WriteString(As<Functor>(obj)->GetFunctorName());
+        }
+    }
+
+    // A dependency is saved as the namespace and name of its binding. If some binding is not
+    // part of the image, the form is saved unfolded: it evaluates its original form.
+    void WriteFoldedForm(FoldedForm* folded) {
+        WriteTag(Tag::FOLDED_FORM);
+        auto& deps = folded->GetDependencies();
+        bool resolved = std::all_of(deps.begin(), deps.end(),
+                                    [this](auto& dep) { return slots_.contains(dep.first); });
+        if (!resolved) {
+            WriteRef(folded->GetOriginal());
+            WriteRef(folded->GetOriginal());
+            WriteU32(0);
+            return;
+        }
+        WriteRef(folded->GetFolded());
+        WriteRef(folded->GetOriginal());
+        WriteU32(deps.size());
+        for (auto [cell, value] : deps) {
+            auto& [ns, name] = slots_.at(cell);
+            WriteRef(ns);
+            WriteString(name);
+            WriteRef(value);
+        }
+    }
+
+    void WriteTag(Tag tag) {
+        out_ += static_cast<char>(tag);
+    }
+
+    template <typename T>
+    void WriteRaw(T value) {
+        out_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    void WriteU32(uint32_t value) {
+        WriteRaw(value);
+    }
+
+    void WriteU64(uint64_t value) {
+        WriteRaw(value);
+    }
+
+    void WriteI64(int64_t value) {
+        WriteRaw(value);
+    }
+
+    void WriteString(const std::string& str) {
+        WriteU32(str.size());
+        out_ += str;
+    }
+
+    void WriteRef(Object* obj) {
+        if (obj == nullptr) {
+            WriteU32(0);
+        } else if (Is<Boolean>(obj)) {
+            WriteU32(As<Boolean>(obj)->GetValue() ? 2 : 1);
+        } else {
+            WriteU32(index_.at(obj) + kFirstObject);
+        }
+    }
+
+    void WriteRefs(const std::vector<Object*>& objs) {
+        WriteU32(objs.size());
+        for (auto obj : objs) {
+            WriteRef(obj);
+        }
+    }
+
+    std::string out_;
+    std::vector<Object*> objects_;
+    std::vector<Object*> pending_;
+    std::unordered_map<Object*, uint32_t> index_;
+    std::unordered_map<const void*, std::pair<NameSpace*, std::string>> slots_;
+};
+
+// Decodes an image in two passes over the records: the first creates every object, the
+// second fills in references between them.
+class ImageReader {
+public:
+    ImageReader(std::string_view data, NameSpace* global) : data_(data), global_(global) {
+        for (auto& [name, value] : global->GetBindings()) {
+            if (IsPrimitive(value)) {
+                primitives_.emplace(As<Functor>(value)->GetFunctorName(), value);
+            }
+        }
+    }
+
+    std::vector<Object*> Decode() {
+        if (data_.size() < sizeof(kMagic) ||
+            std::memcmp(data_.data(), kMagic, sizeof(kMagic)) != 0) {
+            throw RuntimeError("Not an image");
+        }
+        pos_ = sizeof(kMagic);
+        if (ReadU32() != kVersion) {
+            throw RuntimeError("Unsupported image version");
+        }
+        count_ = ReadCount();
+        auto records = pos_;
+        objects_.reserve(count_);
+        for (uint32_t i = 0; i < count_; ++i) {
+            objects_.push_back(Create());
+        }
+        auto roots_pos = pos_;
+
+        pos_ = records;
+        for (uint32_t i = 0; i < count_; ++i) {
+            Fill(objects_[i]);
+        }
+        pos_ = roots_pos;
+        std::vector<Object*> roots(ReadCount());
+        for (auto& root : roots) {
+            root = ReadRef();
+        }
+        if (pos_ != data_.size()) {
+            throw RuntimeError("Corrupt image");
+        }
+
+        // The global namespace is only touched once the whole image has been read.
+        for (auto& [name, value] : globals_) {
+            global_->Set(name, value);
+        }
+        // Assignments in loaded code were never seen by this process.
+        for (auto obj : objects_) {
+            if (Is<Lambda>(obj)) {
+                for (auto form : As<Lambda>(obj)->GetBody()) {
+                    MarkAssigned(form, global_, false);
+                }
+            } else if (Is<Promise>(obj)) {
+                MarkAssigned(As<Promise>(obj)->GetExpression(), global_, false);
+            }
+        }
+        for (auto& [folded, ns, name, value] : deps_) {
+            auto cell = ns->Find(name);
+            if (cell == nullptr) {
+                throw RuntimeError("Corrupt image");
+            }
+            folded->GetDependencies().emplace_back(cell, value);
+        }
+        return roots;
+    }
+
+private:
+    struct Dependency {
+        FoldedForm* folded;
+        NameSpace* ns;
+        std::string name;
+        Object* value;
+    };
+
+    Object* Create() {
+        auto heap = Heap::Instance();
+        switch (ReadTag()) {
+            case Tag::NUMBER:
+                return heap->Make<Number>(ReadI64());
+            case Tag::SYMBOL:
+                return heap->Make<Symbol>(ReadString());
+            case Tag::CELL:
+                SkipRefs(2);
+                return heap->Make<Cell>(nullptr, nullptr);
+            case Tag::NAMESPACE: {
+                auto upper = ReadU32();
+                auto size = ReadCount();
+                for (uint32_t i = 0; i < size; ++i) {
+                    ReadString();
+                    SkipRefs(1);
+                }
+                if (upper == 0) {
+                    return global_;
+                }
+                if (upper < kFirstObject || upper - kFirstObject >= objects_.size()) {
+                    throw RuntimeError("Corrupt image");
+                }
+                return heap->Make<NameSpace>(Cast<NameSpace>(objects_[upper - kFirstObject]));
+            }
+            case Tag::LAMBDA: {
+                auto lambda = heap->Make<Lambda>();
+                lambda->SetName(ReadString());
+                SkipRefs(ReadCount());
+                SkipRefs(ReadCount());
+                SkipRefs(1);
+                return lambda;
+            }
+            case Tag::FOLDED_FORM: {
+                SkipRefs(2);
+                auto size = ReadCount();
+                for (uint32_t i = 0; i < size; ++i) {
+                    SkipRefs(1);
+                    ReadString();
+                    SkipRefs(1);
+                }
+                return heap->Make<FoldedForm>(nullptr, nullptr);
+            }
+            case Tag::MEMOIZED: {
+                SkipRefs(1);
+                auto capacity = ReadU64();
+                if (capacity == 0) {
+                    throw RuntimeError("Corrupt image");
+                }
+                return heap->Make<Memoized>(nullptr, capacity);
+            }
+            case Tag::PRIMITIVE: {
+                auto name = ReadString();
+                auto it = primitives_.find(name);
+                if (it == primitives_.end()) {
+                    throw RuntimeError("Unknown primitive in image: " + name);
+                }
+                return it->second;
+            }
+            case Tag::PROMISE:
+                ReadRaw<uint8_t>();
+                SkipRefs(3);
+                return heap->Make<Promise>();
+            case Tag::MACRO: {
+                auto macro = heap->Make<Macro>();
+                macro->SetName(ReadString());
+                SkipRefs(ReadCount());
+                SkipRefs(ReadCount());
+                SkipRefs(1);
+                return macro;
+            }
+            case Tag::BOX:
+                SkipRefs(1);
+                return heap->Make<Box>(nullptr);
+            case Tag::ALIAS: {
+                auto name = ReadString();
+                SkipRefs(2);
+                return heap->Make<Symbol>(name, nullptr, nullptr);
+            }
+        }
+        throw RuntimeError("Corrupt image");
+    }
+
+    void Fill(Object* obj) {
+        switch (ReadTag()) {
+            case Tag::NUMBER:
+                ReadI64();
+                return;
+            case Tag::SYMBOL:
+                ReadString();
+                return;
+            case Tag::CELL: {
+                auto cell = As<Cell>(obj);
+                cell->GetFirst() = ReadRef();
+                cell->GetSecond() = ReadRef();
+                return;
+            }
+            case Tag::NAMESPACE: {
+                auto ns = As<NameSpace>(obj);
+                SkipRefs(1);
+                auto size = ReadCount();
+                for (uint32_t i = 0; i < size; ++i) {
+                    auto name = ReadString();
+                    if (ns == global_) {
+                        globals_.emplace_back(std::move(name), ReadRef());
+                    } else {
+                        ns->Set(name, ReadRef());
+                    }
+                }
+                return;
+            }
+            case Tag::LAMBDA: {
+                auto lambda = As<Lambda>(obj);
+                ReadString();
+                ReadRefs(lambda->GetArgNames());
+                for (auto arg : lambda->GetArgNames()) {
+                    Cast<Symbol>(arg);
+                }
+                ReadRefs(lambda->GetBody());
+                lambda->GetScope() = Cast<NameSpace>(ReadRef());
+                return;
+            }
+            case Tag::FOLDED_FORM: {
+                auto folded = As<FoldedForm>(obj);
+                folded->GetFolded() = ReadRef();
+                folded->GetOriginal() = ReadRef();
+                auto size = ReadCount();
+                for (uint32_t i = 0; i < size; ++i) {
+                    auto ns = Cast<NameSpace>(ReadRef());
+                    auto name = ReadString();
+                    deps_.push_back({folded, ns, std::move(name), ReadRef()});
+                }
+                return;
+            }
+            case Tag::MEMOIZED:
+                As<Memoized>(obj)->GetFunction() = Cast<Procedure>(ReadRef());
+                ReadU64();
+                return;
+            case Tag::PRIMITIVE:
+                ReadString();
+                return;
+            case Tag::PROMISE: {
+                auto promise = As<Promise>(obj);
+                bool forced = ReadRaw<uint8_t>() != 0;
+                promise->GetExpression() = ReadRef();
+                auto scope = ReadRef();
+                promise->GetScope() = scope == nullptr ? nullptr : Cast<NameSpace>(scope);
+                auto value = ReadRef();
+                if (forced) {
+                    promise->Resolve(value);
+                } else if (promise->GetScope() == nullptr) {
+                    throw RuntimeError("Corrupt image");
+                }
+                return;
+            }
+            case Tag::MACRO: {
+                auto macro = As<Macro>(obj);
+                ReadString();
+                ReadRefs(macro->GetLiterals());
+                ReadRefs(macro->GetRules());
+                macro->GetScope() = Cast<NameSpace>(ReadRef());
+                for (auto symbol : macro->GetLiterals()) {
+                    Cast<Symbol>(symbol);
+                }
+                if (macro->GetRules().size() % 2 != 0) {
+                    throw RuntimeError("Corrupt image");
+                }
+                for (size_t i = 0; i < macro->GetRules().size(); i += 2) {
+                    Cast<Cell>(macro->GetRules()[i]);
+                }
+                return;
+            }
+            case Tag::BOX:
+                As<Box>(obj)->GetValue() = ReadRef();
+                return;
+            case Tag::ALIAS: {
+                auto symbol = As<Symbol>(obj);
+                ReadString();
+                symbol->GetOriginal() = Cast<Symbol>(ReadRef());
+                symbol->GetScope() = Cast<NameSpace>(ReadRef());
+                return;
+            }
+        }
+    }
+
+    template <typename T>
+    T* Cast(Object* obj) {
+        if (!Is<T>(obj)) {
+            throw RuntimeError("Corrupt image");
+        }
+        return As<T>(obj);
+    }
+
+    void Require(size_t size) {
+        if (data_.size() - pos_ < size) {
+            throw RuntimeError("Truncated image");
+        }
+    }
+
+    template <typename T>
+    T ReadRaw() {
+        Require(sizeof(T));
+        T value;
+        std::memcpy(&value, data_.data() + pos_, sizeof(T));
+        pos_ += sizeof(T);
+        return value;
+    }
+
+    Tag ReadTag() {
+        auto tag = ReadRaw<uint8_t>();
+        if (tag > static_cast<uint8_t>(Tag::ALIAS)) {
+            throw RuntimeError("Corrupt image");
+        }
+        return static_cast<Tag>(tag);
+    }
+
+    uint32_t ReadU32() {
+        return ReadRaw<uint32_t>();
+    }
+
+    uint64_t ReadU64() {
+        return ReadRaw<uint64_t>();
+    }
+
+    int64_t ReadI64() {
+        return ReadRaw<int64_t>();
+    }
+
+    // Element counts are bounded by the remaining size, so corrupt counts fail fast instead of
+    // allocating.
+    uint32_t ReadCount() {
+        auto count = ReadU32();
+        Require(count);
+        return count;
+    }
+
+    std::string ReadString() {
+        auto size = ReadCount();
+        std::string res(data_.substr(pos_, size));
+        pos_ += size;
+        return res;
+    }
+
+    // Objects that are not created yet read as nullptr, this only happens in the first pass.
+    Object* ReadRef() {
+        auto ref = ReadU32();
+        if (ref == 0) {
+            return nullptr;
+        } else if (ref < kFirstObject) {
+            return Boolean::Instance(ref == 2);
+        } else if (ref - kFirstObject >= count_) {
+            throw RuntimeError("Corrupt image");
+        } else if (ref - kFirstObject >= objects_.size()) {
+            return nullptr;
+        }
+        return objects_[ref - kFirstObject];
+    }
+
+    void ReadRefs(std::vector<Object*>& objs) {
+        objs.resize(ReadCount());
+        for (auto& obj : objs) {
+            obj = ReadRef();
+        }
+    }
+
+    void SkipRefs(uint32_t count) {
+        for (uint32_t i = 0; i < count; ++i) {
+            ReadRef();
+        }
+    }
+
+    std::string_view data_;
+    size_t pos_ = 0;
+    uint32_t count_ = 0;
+    NameSpace* global_;
+    std::vector<Object*> objects_;
+    std::vector<Dependency> deps_;
+    std::vector<std::pair<std::string, Object*>> globals_;
+    std::unordered_map<std::string, Object*> primitives_;
+};
+
+// Read-only private mapping of a whole file.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw RuntimeError("Can not open " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            throw RuntimeError("Can not read " + path);
+        }
+        size_ = st.st_size;
+        data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data_ == MAP_FAILED) {
+            throw RuntimeError("Can not map " + path);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        munmap(data_, size_);
+    }
+
+    std::string_view GetData() const {
+        return {static_cast<const char*>(data_), size_};
+    }
+
+private:
+    void* data_;
+    size_t size_;
+};
+
+}  // namespace
+
+std::string EncodeImage(std::span<Object* const> roots) {
+    return ImageWriter().Encode(roots);
+}
+
+std::vector<Object*> DecodeImage(std::string_view data, NameSpace* global) {
+    return ImageReader(data, global).Decode();
+}
+
+void SaveImage(NameSpace* global, const std::string& path) {
+    Object* roots[] = {global};
+    auto data = EncodeImage(roots);
+    // Processes loading the image concurrently see either the old or the new file.
+    auto tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out.write(data.data(), data.size());
+        if (!out) {
+            throw RuntimeError("Can not write " + tmp);
+        }
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        throw RuntimeError("Can not write " + path);
+    }
+}
+
+void LoadImage(NameSpace* global, const std::string& path) {
+    MappedFile file(path);
+    DecodeImage(file.GetData(), global);
+}
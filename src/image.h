@@ -0,0 +1,25 @@
+#pragma once
+
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "object.h"
+
+// Binary images of object graphs. Pointers are stored as indices of the objects in the image,
+// so an image does not depend on addresses and can be mapped anywhere. Primitives are stored
+// by name and resolved against the global namespace when the image is decoded, namespaces
+// without a parent are merged into that global namespace. Memoization caches are not saved.
+
+// Serializes roots and every object reachable from them.
+std::string EncodeImage(std::span<Object* const> roots);
+
+// Rebuilds the objects of an image produced by EncodeImage and returns its roots. Throws
+// RuntimeError if the data is truncated or malformed.
+std::vector<Object*> DecodeImage(std::string_view data, NameSpace* global);
+
+// Writes global and everything reachable from it to path.
+void SaveImage(NameSpace* global, const std::string& path);
+
+// Maps the image at path into memory and loads its bindings into global.
+void LoadImage(NameSpace* global, const std::string& path);
@@ -0,0 +1,596 @@
+#include "jit.h"
+
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <initializer_list>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "budget.h"
+#include "error.h"
+#include "scheme.h"
+
+NativeCode::NativeCode(const std::vector<uint8_t>& code, size_t arity, bool returns_bool,
+                       std::vector<std::pair<Object**, Object*>> guards)
+    : arity_(arity), returns_bool_(returns_bool), guards_(std::move(guards)) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_ = (code.size() + page - 1) / page * page;
+    memory_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory_ == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    std::memcpy(memory_, code.data(), code.size());
+    // The code is never writable and executable at the same time.
+    if (mprotect(memory_, size_, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory_, size_);
+        throw std::bad_alloc();
+    }
+    entry_ = reinterpret_cast<Entry>(memory_);
+}
+
+NativeCode::~NativeCode() {
+    munmap(memory_, size_);
+}
+
+Object* NativeCode::Run(std::span<Object*> args, Budget& budget) {
+    if (args.size() != arity_) {
+        return nullptr;
+    }
+    std::array<int64_t, kMaxArgs> values;
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (!Is<Number>(args[i])) {
+            return nullptr;
+        }
+        values[i] = As<Number>(args[i])->GetValue();
+    }
+    // The call is already counted by Lambda::Apply, the compiled body counts it again.
+    State state{0, Budget::GetCountdown() + 1, &budget};
+    auto res = entry_(values.data(), &state);
+    Budget::SetCountdown(state.steps);
+    if (state.bailout != 0) {
+        return nullptr;
+    }
+    if (returns_bool_) {
+        return Boolean::Instance(res != 0);
+    }
+    return Heap::Instance()->Make<Number>(res);
+}
+
+// Guarded objects are kept alive, so a binding can not come to hold a different object at the
+// same address.
+void NativeCode::Mark() {
+    for (auto [cell, value] : guards_) {
+        if (value != nullptr && !value->GetMark()) {
+            value->Mark();
+        }
+    }
+}
+
+#if defined(__x86_64__) && defined(__linux__)
+
+namespace {
+
+enum class Type { NUMBER, BOOLEAN };
+
+// Thrown for forms outside of the compiled subset.
+struct Unsupported {};
+
+static_assert(offsetof(NativeCode::State, steps) == 8);
+
+// Called by compiled code whose step countdown ran out. Returns false to make it bail out.
+bool RefillSteps(NativeCode::State* state) {
+    Budget::SetCountdown(state->steps);
+    if (!state->budget->Refill()) {
+        return false;
+    }
+    state->steps = Budget::GetCountdown();
+    return true;
+}
+
+// Low nibbles of the jcc, setcc and cmovcc opcodes.
+enum ConditionCode : uint8_t {
+    EQUAL = 0x4,
+    NOT_EQUAL = 0x5,
+    SIGN = 0x8,
+    LESS = 0xC,
+    GREATER_EQUAL = 0xD,
+    LESS_EQUAL = 0xE,
+    GREATER = 0xF,
+};
+
+class Assembler {
+public:
+    using Label = size_t;
+
+    void Emit(std::initializer_list<uint8_t> bytes) {
+        code_.insert(code_.end(), bytes);
+    }
+
+    void Emit32(int32_t value) {
+        EmitRaw(value);
+    }
+
+    void Emit64(int64_t value) {
+        EmitRaw(value);
+    }
+
+    Label NewLabel() {
+        labels_.push_back(kUnbound);
+        return labels_.size() - 1;
+    }
+
+    void Bind(Label label) {
+        labels_[label] = code_.size();
+    }
+
+    void Jump(Label label) {
+        Emit({0xE9});
+        EmitTarget(label);
+    }
+
+    void JumpIf(ConditionCode cc, Label label) {
+        Emit({0x0F, static_cast<uint8_t>(0x80 | cc)});
+        EmitTarget(label);
+    }
+
+    void Call(Label label) {
+        Emit({0xE8});
+        EmitTarget(label);
+    }
+
+    std::vector<uint8_t> Finish() {
+        for (auto [pos, label] : fixups_) {
+            int32_t rel = labels_[label] - (pos + 4);
+            std::memcpy(code_.data() + pos, &rel, sizeof(rel));
+        }
+        return std::move(code_);
+    }
+
+private:
+    static constexpr size_t kUnbound = static_cast<size_t>(-1);
+
+    template <typename T>
+    void EmitRaw(T value) {
+        auto bytes = reinterpret_cast<const uint8_t*>(&value);
+        code_.insert(code_.end(), bytes, bytes + sizeof(value));
+    }
+
+    void EmitTarget(Label label) {
+        fixups_.emplace_back(code_.size(), label);
+        Emit32(0);
+    }
+
+    std::vector<uint8_t> code_;
+    std::vector<size_t> labels_;
+    std::vector<std::pair<size_t, Label>> fixups_;
+};
+
+// Generates code for the body of a lambda. Values are computed in rax, with numbers as int64
+// and booleans as 0 or 1; temporaries are pushed on the machine stack. Compiled functions
+// take their arguments on the stack, r12 points to the NativeCode::State and rbx counts the
+// frames left before the code gives up on deep recursion. Every call is a step of Budget: when
+// the countdown in the state runs out, RefillSteps is called, and the code bails out if a limit
+// has been exceeded.
+//
+// The entry point follows the C calling convention: int64_t (const int64_t* args,
+// NativeCode::State* state).
+class Compiler {
+public:
+    // Native recursion is cut off well before the machine stack runs out.
+    static constexpr int32_t kMaxDepth = 50000;
+
+    Compiler(Lambda* lambda, Type result)
+        : lambda_(lambda), scope_(lambda->GetScope()), result_(result) {
+    }
+
+    Type Run() {
+        auto& params = lambda_->GetArgNames();
+        body_ = as_.NewLabel();
+        epilogue_ = as_.NewLabel();
+        bail_ = as_.NewLabel();
+        auto refill = as_.NewLabel();
+        auto counted = as_.NewLabel();
+
+        // push rbp; mov rbp, rsp; push r12; push rbx; mov r12, rsi; mov rbx, kMaxDepth
+        as_.Emit({0x55, 0x48, 0x89, 0xE5, 0x41, 0x54, 0x53, 0x49, 0x89, 0xF4, 0x48, 0xC7, 0xC3});
+        as_.Emit32(kMaxDepth);
+        for (size_t i = 0; i < params.size(); ++i) {
+            // push qword [rdi + 8 * i]
+            as_.Emit({0xFF, 0xB7});
+            as_.Emit32(8 * i);
+        }
+        as_.Call(body_);
+        // lea rsp, [rbp - 16]; pop rbx; pop r12; pop rbp; ret
+        as_.Emit({0x48, 0x8D, 0x65, 0xF0, 0x5B, 0x41, 0x5C, 0x5D, 0xC3});
+
+        as_.Bind(body_);
+        // push rbp; mov rbp, rsp; sub rbx, 1
+        as_.Emit({0x55, 0x48, 0x89, 0xE5, 0x48, 0x83, 0xEB, 0x01});
+        as_.JumpIf(EQUAL, bail_);
+        // sub qword [r12 + 8], 1
+        as_.Emit({0x49, 0x83, 0x6C, 0x24, 0x08, 0x01});
+        as_.JumpIf(LESS_EQUAL, refill);
+        as_.Bind(counted);
+        Type type = Type::NUMBER;
+        for (auto form : lambda_->GetBody()) {
+            type = Compile(form);
+        }
+        as_.Bind(epilogue_);
+        // add rbx, 1; mov rsp, rbp; pop rbp; ret
+        as_.Emit({0x48, 0x83, 0xC3, 0x01, 0x48, 0x89, 0xEC, 0x5D, 0xC3});
+        as_.Bind(bail_);
+        // mov byte [r12], 1
+        as_.Emit({0x41, 0xC6, 0x04, 0x24, 0x01});
+        as_.Jump(epilogue_);
+
+        // Nothing is pushed yet, so rsp is still rbp.
+        as_.Bind(refill);
+        // and rsp, -16; mov rdi, r12; mov rax, RefillSteps; call rax; mov rsp, rbp; test al, al
+        as_.Emit({0x48, 0x83, 0xE4, 0xF0, 0x4C, 0x89, 0xE7, 0x48, 0xB8});
+        as_.Emit64(reinterpret_cast<int64_t>(&RefillSteps));
+        as_.Emit({0xFF, 0xD0, 0x48, 0x89, 0xEC, 0x84, 0xC0});
+        as_.JumpIf(EQUAL, bail_);
+        as_.Jump(counted);
+        return type;
+    }
+
+    bool UsesSelf() const {
+        return uses_self_;
+    }
+
+    std::vector<uint8_t> Finish() {
+        return as_.Finish();
+    }
+
+    std::vector<std::pair<Object**, Object*>>& GetGuards() {
+        return guards_;
+    }
+
+private:
+    Type Compile(Object* form) {
+        if (Is<Number>(form)) {
+            LoadNumber(As<Number>(form)->GetValue());
+            return Type::NUMBER;
+        } else if (Is<Boolean>(form)) {
+            LoadBoolean(As<Boolean>(form)->GetValue());
+            return Type::BOOLEAN;
+        } else if (Is<Symbol>(form)) {
+            if (FindParam(Get<Symbol>(form)) < 0) {
+                return CompileConstant(As<Symbol>(form));
+            }
+            LoadParam(ParamIndex(Get<Symbol>(form)));
+            return Type::NUMBER;
+        } else if (Is<FoldedForm>(form)) {
+            auto folded = As<FoldedForm>(form);
+            if (!folded->IsValid() || folded->GetFolded() == nullptr) {
+                return Compile(folded->GetOriginal());
+            }
+            auto& deps = folded->GetDependencies();
+            guards_.insert(guards_.end(), deps.begin(), deps.end());
+            return Compile(folded->GetFolded());
+        } else if (Is<Cell>(form)) {
+            return CompileCall(As<Cell>(form));
+        }
+        throw Unsupported();
+    }
+
+    // A global constant is compiled as its value, guarded like a folded form.
+    Type CompileConstant(Symbol* symbol) {
+        auto slot = scope_->Find(symbol);
+        if (slot == nullptr || !(Is<Number>(*slot) || Is<Boolean>(*slot))) {
+            throw Unsupported();
+        }
+        guards_.emplace_back(slot, *slot);
+        return Compile(*slot);
+    }
+
+    void CompileNumber(Object* form) {
+        if (Compile(form) != Type::NUMBER) {
+            throw Unsupported();
+        }
+    }
+
+    Type CompileCall(Cell* cell) {
+        if (!Is<Symbol>(cell->GetFirst()) || !IsListHelper(cell->GetSecond())) {
+            throw Unsupported();
+        }
+        auto name = Get<Symbol>(cell->GetFirst());
+        if (FindParam(name) >= 0) {
+            throw Unsupported();
+        }
+        auto slot = scope_->Find(As<Symbol>(cell->GetFirst()));
+        if (slot == nullptr) {
+            throw Unsupported();
+        }
+        auto func = *slot;
+        guards_.emplace_back(slot, func);
+        auto args = ToVector(cell->GetSecond());
+
+        if (func == lambda_) {
+            return CompileSelfCall(args);
+        } else if (Is<If>(func)) {
+            return CompileIf(args);
+        } else if (Is<And>(func) || Is<Or>(func)) {
+            return CompileLogic(args, Is<And>(func));
+        } else if (Is<Not>(func)) {
+            return CompileNot(args);
+        } else if (Is<EqualTo>(func)) {
+            return CompileComparison(args, EQUAL);
+        } else if (Is<Less>(func)) {
+            return CompileComparison(args, LESS);
+        } else if (Is<Greater>(func)) {
+            return CompileComparison(args, GREATER);
+        } else if (Is<LessEqual>(func)) {
+            return CompileComparison(args, LESS_EQUAL);
+        } else if (Is<GreaterEqual>(func)) {
+            return CompileComparison(args, GREATER_EQUAL);
+        } else if (Is<Plus>(func) || Is<Minus>(func) || Is<Multiplies>(func) ||
+                   Is<Divides>(func) || Is<Max>(func) || Is<Min>(func)) {
+            return CompileArithmetic(args, func);
+        } else if (Is<Abs>(func)) {
+            return CompileAbs(args);
+        }
+        throw Unsupported();
+    }
+
+    Type CompileSelfCall(std::vector<Object*>& args) {
+        if (args.size() != lambda_->GetArgNames().size()) {
+            throw Unsupported();
+        }
+        for (auto arg : args) {
+            CompileNumber(arg);
+            as_.Emit({0x50});  // push rax
+        }
+        as_.Call(body_);
+        if (!args.empty()) {
+            // add rsp, 8 * n
+            as_.Emit({0x48, 0x81, 0xC4});
+            as_.Emit32(8 * args.size());
+        }
+        // cmp byte [r12], 0
+        as_.Emit({0x41, 0x80, 0x3C, 0x24, 0x00});
+        as_.JumpIf(NOT_EQUAL, epilogue_);
+        uses_self_ = true;
+        return result_;
+    }
+
+    Type CompileIf(std::vector<Object*>& args) {
+        if (args.size() != 3) {
+            throw Unsupported();
+        }
+        // Only #f is false, so a numeric condition always takes the first branch.
+        if (Compile(args[0]) == Type::NUMBER) {
+            return Compile(args[1]);
+        }
+        auto otherwise = as_.NewLabel();
+        auto end = as_.NewLabel();
+        TestResult();
+        as_.JumpIf(EQUAL, otherwise);
+        auto type = Compile(args[1]);
+        as_.Jump(end);
+        as_.Bind(otherwise);
+        if (Compile(args[2]) != type) {
+            throw Unsupported();
+        }
+        as_.Bind(end);
+        return type;
+    }
+
+    Type CompileLogic(std::vector<Object*>& args, bool is_and) {
+        if (args.empty()) {
+            LoadBoolean(is_and);
+            return Type::BOOLEAN;
+        }
+        auto end = as_.NewLabel();
+        for (size_t i = 0; i < args.size(); ++i) {
+            if (Compile(args[i]) != Type::BOOLEAN) {
+                throw Unsupported();
+            }
+            if (i + 1 < args.size()) {
+                TestResult();
+                as_.JumpIf(is_and ? EQUAL : NOT_EQUAL, end);
+            }
+        }
+        as_.Bind(end);
+        return Type::BOOLEAN;
+    }
+
+    Type CompileNot(std::vector<Object*>& args) {
+        if (args.size() != 1) {
+            throw Unsupported();
+        }
+        if (Compile(args[0]) == Type::BOOLEAN) {
+            as_.Emit({0x83, 0xF0, 0x01});  // xor eax, 1
+        } else {
+            LoadBoolean(false);
+        }
+        return Type::BOOLEAN;
+    }
+
+    Type CompileComparison(std::vector<Object*>& args, ConditionCode cc) {
+        if (args.size() != 2) {
+            throw Unsupported();
+        }
+        CompileOperands(args[0], args[1]);
+        // cmp rax, rcx; setcc al; movzx eax, al
+        as_.Emit({0x48, 0x39, 0xC8, 0x0F, static_cast<uint8_t>(0x90 | cc), 0xC0, 0x0F, 0xB6,
+                  0xC0});
+        return Type::BOOLEAN;
+    }
+
+    // Mirrors the interpreter: + and * start from their neutral element, - and / with one
+    // argument apply it to 0 and 1, max and min need at least one argument.
+    Type CompileArithmetic(std::vector<Object*>& args, Object* func) {
+        bool is_inverse = Is<Minus>(func) || Is<Divides>(func);
+        if (args.empty()) {
+            if (!Is<Plus>(func) && !Is<Multiplies>(func)) {
+                throw Unsupported();
+            }
+            LoadNumber(Is<Multiplies>(func) ? 1 : 0);
+            return Type::NUMBER;
+        }
+        if (args.size() == 1 && is_inverse) {
+            CompileNumber(args[0]);
+            if (Is<Minus>(func)) {
+                as_.Emit({0x48, 0xF7, 0xD8});  // neg rax
+            } else {
+                // mov rcx, rax; mov eax, 1
+                as_.Emit({0x48, 0x89, 0xC1, 0xB8, 0x01, 0x00, 0x00, 0x00});
+                EmitDivide();
+            }
+            return Type::NUMBER;
+        }
+        CompileNumber(args[0]);
+        for (size_t i = 1; i < args.size(); ++i) {
+            as_.Emit({0x50});  // push rax
+            CompileNumber(args[i]);
+            // mov rcx, rax; pop rax
+            as_.Emit({0x48, 0x89, 0xC1, 0x58});
+            if (Is<Plus>(func)) {
+                as_.Emit({0x48, 0x01, 0xC8});  // add rax, rcx
+            } else if (Is<Minus>(func)) {
+                as_.Emit({0x48, 0x29, 0xC8});  // sub rax, rcx
+            } else if (Is<Multiplies>(func)) {
+                as_.Emit({0x48, 0x0F, 0xAF, 0xC1});  // imul rax, rcx
+            } else if (Is<Divides>(func)) {
+                EmitDivide();
+            } else {
+                // cmp rax, rcx; cmovl / cmovg rax, rcx
+                auto cc = Is<Max>(func) ? LESS : GREATER;
+                as_.Emit({0x48, 0x39, 0xC8, 0x48, 0x0F, static_cast<uint8_t>(0x40 | cc), 0xC1});
+            }
+        }
+        return Type::NUMBER;
+    }
+
+    Type CompileAbs(std::vector<Object*>& args) {
+        if (args.size() != 1) {
+            throw Unsupported();
+        }
+        CompileNumber(args[0]);
+        // mov rcx, rax; neg rax; cmovs rax, rcx
+        as_.Emit({0x48, 0x89, 0xC1, 0x48, 0xF7, 0xD8, 0x48, 0x0F, static_cast<uint8_t>(0x40 | SIGN),
+                  0xC1});
+        return Type::NUMBER;
+    }
+
+    // Leaves the first operand in rax and the second one in rcx.
+    void CompileOperands(Object* first, Object* second) {
+        CompileNumber(first);
+        as_.Emit({0x50});  // push rax
+        CompileNumber(second);
+        // mov rcx, rax; pop rax
+        as_.Emit({0x48, 0x89, 0xC1, 0x58});
+    }
+
+    // rax = rax / rcx. Division by zero and the overflowing INT64_MIN / -1 are left to the
+    // interpreter.
+    void EmitDivide() {
+        auto divide = as_.NewLabel();
+        // test rcx, rcx
+        as_.Emit({0x48, 0x85, 0xC9});
+        as_.JumpIf(EQUAL, bail_);
+        // cmp rcx, -1
+        as_.Emit({0x48, 0x83, 0xF9, 0xFF});
+        as_.JumpIf(NOT_EQUAL, divide);
+        // movabs rdx, INT64_MIN; cmp rax, rdx
+        as_.Emit({0x48, 0xBA});
+        as_.Emit64(INT64_MIN);
+        as_.Emit({0x48, 0x39, 0xD0});
+        as_.JumpIf(EQUAL, bail_);
+        as_.Bind(divide);
+        // cqo; idiv rcx
+        as_.Emit({0x48, 0x99, 0x48, 0xF7, 0xF9});
+    }
+
+    void LoadNumber(int64_t value) {
+        // movabs rax, value
+        as_.Emit({0x48, 0xB8});
+        as_.Emit64(value);
+    }
+
+    void LoadBoolean(bool value) {
+        // mov eax, value
+        as_.Emit({0xB8});
+        as_.Emit32(value ? 1 : 0);
+    }
+
+    void LoadParam(size_t index) {
+        auto count = lambda_->GetArgNames().size();
+        // mov rax, [rbp + 16 + 8 * (count - 1 - index)]
+        as_.Emit({0x48, 0x8B, 0x85});
+        as_.Emit32(16 + 8 * (count - 1 - index));
+    }
+
+    void TestResult() {
+        as_.Emit({0x48, 0x85, 0xC0});  // test rax, rax
+    }
+
+    // The last parameter wins if names repeat, as in the interpreter.
+    int FindParam(const std::string& name) const {
+        auto& params = lambda_->GetArgNames();
+        for (int i = params.size() - 1; i >= 0; --i) {
+            if (Get<Symbol>(params[i]) == name) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    size_t ParamIndex(const std::string& name) const {
+        auto index = FindParam(name);
+        if (index < 0) {
+            throw Unsupported();
+        }
+        return index;
+    }
+
+    Lambda* lambda_;
+    NameSpace* scope_;
+    Type result_;
+    Assembler as_;
+    Assembler::Label body_ = 0, epilogue_ = 0, bail_ = 0;
+    bool uses_self_ = false;
+    std::vector<std::pair<Object**, Object*>> guards_;
+};
+
+}  // namespace
+
+// A self-recursive body is compiled assuming each result type in turn, the assumption has to
+// match the type of the body.
+std::shared_ptr<NativeCode> Jit::Compile(Lambda* lambda) {
+    auto& params = lambda->GetArgNames();
+    auto scope = lambda->GetScope();
+    if (scope == nullptr || scope->GetUpper() != nullptr || params.size() > NativeCode::kMaxArgs) {
+        return nullptr;
+    }
+    for (auto param : params) {
+        if (!Is<Symbol>(param)) {
+            return nullptr;
+        }
+    }
+    for (auto assumed : {Type::NUMBER, Type::BOOLEAN}) {
+        Compiler compiler(lambda, assumed);
+        Type type;
+        try {
+            type = compiler.Run();
+        } catch (Unsupported&) {
+            continue;
+        }
+        if (compiler.UsesSelf() && type != assumed) {
+            continue;
+        }
+        return std::make_shared<NativeCode>(compiler.Finish(), params.size(),
+                                            type == Type::BOOLEAN,
+                                            std::move(compiler.GetGuards()));
+    }
+    return nullptr;
+}
+
+#else
+
+std::shared_ptr<NativeCode> Jit::Compile(Lambda*) {
+    return nullptr;
+}
+
+#endif
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <utility>
+#include <vector>
+#include "object.h"
+
+// Machine code compiled from a lambda. It is only valid while the bindings it was compiled
+// against (primitives, the lambda itself, folded constants) still hold the same objects and
+// only runs on numeric arguments; otherwise, and when the code bails out on something it
+// does not handle (division by zero), the caller evaluates the lambda as usual.
+
+class NativeCode {
+public:
+    // Shared with the compiled code, which addresses the fields by offset. steps is the
+    // countdown of budget, decremented on every call.
+    struct State {
+        uint8_t bailout = 0;
+        int64_t steps = 0;
+        Budget* budget = nullptr;
+    };
+
+    using Entry = int64_t (*)(const int64_t* args, State* state);
+
+    static constexpr size_t kMaxArgs = 8;
+
+    NativeCode(const std::vector<uint8_t>& code, size_t arity, bool returns_bool,
+               std::vector<std::pair<Object**, Object*>> guards);
+
+    NativeCode(const NativeCode&) = delete;
+    NativeCode& operator=(const NativeCode&) = delete;
+
+    ~NativeCode();
+
+    bool IsValid() const {
+        for (auto [cell, value] : guards_) {
+            if (*cell != value) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Returns nullptr if the call has to be interpreted. Calls count as steps of budget.
+    Object* Run(std::span<Object*> args, Budget& budget);
+
+    void Mark();
+
+private:
+    void* memory_;
+    size_t size_;
+    Entry entry_;
+    size_t arity_;
+    bool returns_bool_;
+    std::vector<std::pair<Object**, Object*>> guards_;
+};
+
+// Compiles hot lambdas to x86-64 code. A lambda is compiled after kHotThreshold calls if it
+// is defined at top level and its body only uses its parameters, global constants, number and
+// boolean literals, if, and, or, not, arithmetic, comparisons and calls to itself, all
+// statically typed as either numbers or booleans.
+
+class Jit {
+public:
+    static constexpr uint32_t kHotThreshold = 64;
+
+#if defined(__x86_64__) && defined(__linux__)
+    static constexpr bool kSupported = true;
+#else
+    static constexpr bool kSupported = false;
+#endif
+
+    static bool IsEnabled() {
+        return enabled_;
+    }
+
+    static void SetEnabled(bool enabled) {
+        enabled_ = kSupported && enabled;
+    }
+
+    // Returns nullptr if the lambda can not be compiled.
+    static std::shared_ptr<NativeCode> Compile(Lambda* lambda);
+
+private:
+    static inline bool enabled_ = kSupported;
+};
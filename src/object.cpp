@@ -1,13 +1,211 @@
+#include <array>
+#include <chrono>
 #include <climits>
 #include <cstddef>
 #include <cstdint>
 #include <functional>
+#include <iterator>
+#include <shared_mutex>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 #include <algorithm>
 #include "object.h"
+#include "budget.h"
+#include "constant_pool.h"
 #include "error.h"
+#include "jit.h"
+#include "profiler.h"
+#include "scheduler.h"
 #include "scheme.h"
 
+const char* ObjectKindName(ObjectKind kind) {
+    switch (kind) {
+        case ObjectKind::NUMBER:
+            return "number";
+        case ObjectKind::SYMBOL:
+            return "symbol";
+        case ObjectKind::CELL:
+            return "cell";
+        case ObjectKind::NAMESPACE:
+            return "namespace";
+        case ObjectKind::LAMBDA:
+            return "lambda";
+        case ObjectKind::PRIMITIVE:
+            return "primitive";
+        case ObjectKind::FOLDED_FORM:
+            return "folded-form";
+        case ObjectKind::BOX:
+            return "box";
+        default:
+            return "other";
+    }
+}
+
+Heap::~Heap() {
+    {
+        std::lock_guard lock(collector_mutex_);
+        stop_ = true;
+    }
+    wake_.notify_one();
+    if (collector_.joinable()) {
+        collector_.join();
+    }
+}
+
+void Heap::Clear() {
+    WaitForCollection();
+    stats_.objects_freed += stats_.live_objects;
+    stats_.bytes_freed += stats_.live_bytes;
+    stats_.live_objects = 0;
+    stats_.live_bytes = 0;
+    data_.clear();
+    old_.clear();
+}
+
+// The pause is only the hand-over: the objects allocated since the last collection are moved
+// to the collector with their vector.
+void Heap::Collect(Object* root) {
+    auto begin = std::chrono::steady_clock::now();
+    {
+        std::lock_guard lock(collector_mutex_);
+        if (collecting_) {
+            return;
+        }
+        Publish();
+        snapshot_.swap(data_);
+        root_ = root;
+        collecting_ = true;
+        marking_.store(true, std::memory_order_release);
+        if (!collector_.joinable()) {
+            collector_ = std::thread([this] { CollectorLoop(); });
+        }
+    }
+    wake_.notify_one();
+    RecordPause(begin);
+}
+
+void Heap::WaitForCollection() {
+    auto begin = std::chrono::steady_clock::now();
+    std::unique_lock lock(collector_mutex_);
+    if (!collecting_ && !result_) {
+        return;
+    }
+    done_.wait(lock, [this] { return !collecting_; });
+    Publish();
+    lock.unlock();
+    RecordPause(begin);
+}
+
+void Heap::Remember(Object* obj) {
+    std::lock_guard lock(remembered_mutex_);
+    if (marking_.load(std::memory_order_relaxed)) {
+        remembered_.push_back(obj);
+    }
+}
+
+void Heap::CollectorLoop() {
+    std::unique_lock lock(collector_mutex_);
+    while (true) {
+        wake_.wait(lock, [this] { return stop_ || root_ != nullptr; });
+        if (root_ == nullptr) {
+            return;
+        }
+        auto root = std::exchange(root_, nullptr);
+        lock.unlock();
+        auto result = MarkAndSweep(root);
+        lock.lock();
+        result_ = result;
+        collecting_ = false;
+        done_.notify_all();
+    }
+}
+
+// Marking ends once nothing overwritten is left to mark; a barrier that runs later finds
+// marking_ cleared, and what it would log was reachable when the last one was drained.
+Heap::CollectionResult Heap::MarkAndSweep(Object* root) {
+    auto begin = std::chrono::steady_clock::now();
+
+    old_.insert(old_.end(), std::make_move_iterator(snapshot_.begin()),
+                std::make_move_iterator(snapshot_.end()));
+    snapshot_.clear();
+    for (auto& e : old_) {
+        e->UnMark();
+    }
+
+    root->Mark();
+    std::vector<Object*> pending;
+    while (true) {
+        {
+            std::lock_guard lock(remembered_mutex_);
+            if (remembered_.empty()) {
+                marking_.store(false, std::memory_order_release);
+                break;
+            }
+            pending.swap(remembered_);
+        }
+        for (auto obj : pending) {
+            if (!obj->GetMark()) {
+                obj->Mark();
+            }
+        }
+        pending.clear();
+    }
+
+    CollectionResult res;
+    for (size_t i = 0; i < old_.size(); ++i) {
+        while (i < old_.size() && (old_[i] == nullptr || !old_[i]->GetMark())) {
+            if (old_[i] != nullptr) {
+                ++res.freed;
+                res.freed_bytes += old_[i]->size_;
+            }
+            std::swap(old_[i], old_.back());
+            old_.pop_back();
+        }
+    }
+    res.survivors = old_.size();
+    res.duration_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - begin)
+                          .count();
+    return res;
+}
+
+void Heap::Publish() {
+    if (!result_) {
+        return;
+    }
+    ++stats_.collections;
+    stats_.objects_freed += result_->freed;
+    stats_.bytes_freed += result_->freed_bytes;
+    stats_.survivors = result_->survivors;
+    stats_.live_objects -= result_->freed;
+    stats_.live_bytes -= result_->freed_bytes;
+    stats_.total_background_ns += result_->duration_ns;
+    result_.reset();
+}
+
+void Heap::RecordPause(std::chrono::steady_clock::time_point begin) {
+    auto pause = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now() - begin)
+                     .count();
+    stats_.total_pause_ns += pause;
+    stats_.max_pause_ns = std::max<uint64_t>(stats_.max_pause_ns, pause);
+    size_t bucket = 0;
+    for (auto us = pause / 1000; us > 0 && bucket + 1 < HeapStats::kPauseBuckets; us /= 2) {
+        ++bucket;
+    }
+    ++stats_.pause_histogram[bucket];
+}
+
+void Heap::Adopt(AllocationBuffer* buffer) {
+    for (auto obj : buffer->objects) {
+        obj->task_local_ = false;
+        data_.emplace_back(obj);
+        Account(obj);
+    }
+    buffer->objects.clear();
+}
+
 Object* Cell::Copy() {
     auto res = Heap::Instance()->Make<Cell>(nullptr, nullptr);
     if (this == first_) {
@@ -23,19 +221,215 @@ Object* Cell::Copy() {
     return res;
 }
 
+// While asynchronous tasks run, the main thread changes namespaces under an exclusive lock and
+// tasks look names up under a shared one. The same goes for the collector while it marks.
+// Otherwise nobody reads what another thread writes.
+std::shared_mutex namespace_mutex;
+
+std::shared_lock<std::shared_mutex> LockForLookup() {
+    if (Heap::InTask() && Scheduler::HasAsyncWork()) {
+        return std::shared_lock(namespace_mutex);
+    }
+    return {};
+}
+
+std::unique_lock<std::shared_mutex> LockForUpdate() {
+    if (!Heap::InTask() && (Scheduler::HasAsyncWork() || Heap::IsMarking())) {
+        return std::unique_lock(namespace_mutex);
+    }
+    return {};
+}
+
+// A binding that closures share is used through its box.
+Object*& Unbox(Object*& slot) {
+    if (slot != nullptr && slot->GetKind() == ObjectKind::BOX) {
+        return static_cast<Box*>(slot)->GetValue();
+    }
+    return slot;
+}
+
 Object*& NameSpace::Get(const std::string& name) {
+    if (auto cell = Find(name)) {
+        return *cell;
+    }
+    throw NameError(name + " not found");
+}
+
+Object** NameSpace::Find(const std::string& name) {
+    auto lock = LockForLookup();
     auto cur = this;
     while (cur != nullptr) {
-        if (cur->data_.contains(name)) {
-            return cur->data_[name];
+        if (auto it = cur->data_.find(name); it != cur->data_.end()) {
+            return &Unbox(it->second);
         }
         cur = cur->upper_;
     }
-    throw NameError(name + " not found");
+    return nullptr;
+}
+
+// A symbol of a macro expansion that the chain does not bind is looked up as its original in
+// the scope of the macro.
+Object** NameSpace::Find(Symbol* symbol) {
+    for (auto scope = this; symbol != nullptr;
+         scope = symbol->scope_, symbol = symbol->original_) {
+        if (auto slot = scope->Find(symbol->name_)) {
+            return slot;
+        }
+    }
+    return nullptr;
+}
+
+NameSpace* NameSpace::FindOwner(const std::string& name) {
+    auto lock = LockForLookup();
+    auto cur = this;
+    while (cur != nullptr && !cur->data_.contains(name)) {
+        cur = cur->upper_;
+    }
+    return cur;
+}
+
+std::pair<NameSpace*, Symbol*> NameSpace::Resolve(Symbol* symbol) {
+    for (auto scope = this; symbol != nullptr;
+         scope = symbol->scope_, symbol = symbol->original_) {
+        if (auto owner = scope->FindOwner(symbol->name_)) {
+            return {owner, symbol};
+        }
+    }
+    return {nullptr, nullptr};
+}
+
+// A parallel task only boxes bindings of its own frames.
+Box* NameSpace::Share(Symbol* symbol) {
+    auto it = data_.find(symbol->name_);
+    if (it->second != nullptr && it->second->GetKind() == ObjectKind::BOX) {
+        return static_cast<Box*>(it->second);
+    }
+    if (Heap::InTask() && !IsRegional() && !IsTaskLocal()) {
+        return nullptr;
+    }
+    auto box = Heap::Instance()->Make<Box>(it->second);
+    auto lock = LockForUpdate();
+    Heap::WriteBarrier(it->second);
+    it->second = box;
+    return box;
+}
+
+// Parallel tasks read the inline caches but leave filling them to the main thread, which does
+// not fill them either while asynchronous tasks may read them.
+// A symbol of a macro defined globally that nothing binds caches the binding of its original.
+Object*& NameSpace::Get(Symbol* symbol) {
+    if (symbol->cached_global_ == global_ && !symbol->info_->bound_locally) {
+        return *symbol->cached_cell_;
+    }
+    bool cacheable = !symbol->info_->bound_locally && !Heap::InTask() &&
+                     !Scheduler::HasAsyncWork();
+    {
+        auto lock = LockForLookup();
+        auto cur = this;
+        while (cur != nullptr) {
+            if (auto it = cur->data_.find(symbol->name_); it != cur->data_.end()) {
+                if (cur == global_ && cacheable) {
+                    symbol->cached_global_ = global_;
+                    symbol->cached_cell_ = &it->second;
+                }
+                return Unbox(it->second);
+            }
+            cur = cur->upper_;
+        }
+    }
+    if (symbol->scope_ == nullptr) {
+        throw NameError(symbol->name_ + " not found");
+    }
+    auto& value = symbol->scope_->Get(symbol->original_);
+    if (symbol->scope_ == global_ && cacheable) {
+        symbol->cached_global_ = global_;
+        symbol->cached_cell_ = &value;
+    }
+    return value;
+}
+
+void MarkBoundLocally(SymbolInfo* info) {
+    if (!info->bound_locally.load(std::memory_order_relaxed)) {
+        info->bound_locally.store(true, std::memory_order_relaxed);
+    }
 }
 
+// Regional frames are out of reach of other threads, the collector included.
 void NameSpace::Set(const std::string& name, Object* obj) {
-    data_[name] = obj;
+    if (upper_ != nullptr) {
+        MarkBoundLocally(Symbol::Intern(name));
+    }
+    if (IsRegional()) {
+        data_[name] = obj;
+        return;
+    }
+    auto lock = LockForUpdate();
+    auto& slot = data_[name];
+    Heap::WriteBarrier(slot);
+    slot = obj;
+}
+
+// Binding a symbol of a macro expansion anywhere drops the cached binding of its original.
+void NameSpace::Set(Symbol* symbol, Object* obj) {
+    if (upper_ != nullptr || symbol->original_ != nullptr) {
+        MarkBoundLocally(symbol->info_);
+    }
+    if (IsRegional()) {
+        data_[symbol->name_] = obj;
+        return;
+    }
+    auto lock = LockForUpdate();
+    auto& slot = data_[symbol->name_];
+    Heap::WriteBarrier(slot);
+    slot = obj;
+}
+
+void Box::Mark() {
+    used_ = true;
+    Object* value;
+    {
+        auto lock = std::shared_lock(namespace_mutex);
+        value = value_;
+    }
+    if (value != nullptr && !value->GetMark()) {
+        value->Mark();
+    }
+}
+
+void Symbol::Mark() {
+    used_ = true;
+    if (original_ != nullptr && !original_->GetMark()) {
+        original_->Mark();
+    }
+    if (scope_ != nullptr && !scope_->GetMark()) {
+        scope_->Mark();
+    }
+}
+
+// The bindings are copied out first: marking them takes the lock again for nested namespaces.
+void NameSpace::Mark() {
+    used_ = true;
+    std::vector<Object*> values;
+    {
+        auto lock = std::shared_lock(namespace_mutex);
+        values.reserve(data_.size() + 1);
+        values.push_back(upper_);
+        for (auto [key, value] : data_) {
+            values.push_back(value);
+        }
+    }
+    for (auto value : values) {
+        if (value != nullptr && !value->GetMark()) {
+            value->Mark();
+        }
+    }
+}
+
+SymbolInfo* Symbol::Intern(const std::string& name) {
+    static std::mutex mutex;
+    static std::unordered_map<std::string, SymbolInfo> table;
+    std::lock_guard lock(mutex);
+    return &table[name];
 }
 
 template <typename T>
@@ -52,12 +446,21 @@ struct MinFunctor {
     }
 };
 
+// Cyclic lists are not proper either: slow follows at half the speed and catches up with obj
+// only if the list loops.
 std::vector<Object*> ToVector(Object* obj) {
     std::vector<Object*> result;
+    auto slow = obj;
     while (Is<Cell>(obj)) {
         auto cell = As<Cell>(obj);
         result.push_back(cell->GetFirst());
         obj = cell->GetSecond();
+        if (result.size() % 2 == 0) {
+            slow = As<Cell>(slow)->GetSecond();
+            if (slow == obj) {
+                throw RuntimeError("Must be proper list");
+            }
+        }
     }
     if (obj != nullptr) {
         throw RuntimeError("Must be proper list");
@@ -65,83 +468,73 @@ std::vector<Object*> ToVector(Object* obj) {
     return result;
 }
 
-Object* FromVector(std::vector<Object*>& vec) {
+ArgBuffer::ArgBuffer(Object* list) {
+    while (Is<Cell>(list)) {
+        auto cell = As<Cell>(list);
+        PushBack(cell->GetFirst());
+        list = cell->GetSecond();
+    }
+    if (list != nullptr) {
+        throw RuntimeError("Must be proper list");
+    }
+}
+
+Object* FromVector(std::span<Object*> vec) {
     Object* right = nullptr;
-    while (!vec.empty()) {
-        auto temp = Heap::Instance()->Make<Cell>(vec.back(), right);
-        right = temp;
-        vec.pop_back();
+    for (auto it = vec.rbegin(); it != vec.rend(); ++it) {
+        right = Heap::Instance()->Make<Cell>(*it, right);
     }
     return right;
 }
 
-void RequiresOnlyXArguments(std::vector<Object*>& a, size_t x) {
+void RequiresOnlyXArguments(std::span<Object*> a, size_t x) {
     if (a.size() != x) {
         throw RuntimeError("Requires only " + std::to_string(x) + " arguments, but got " +
                            std::to_string(a.size()));
     }
 }
 
-void RequiresOnlyXArgumentsS(std::vector<Object*>& a, size_t x) {
+void RequiresOnlyXArgumentsS(std::span<Object*> a, size_t x) {
     if (a.size() != x) {
         throw SyntaxError("Requires only " + std::to_string(x) + " arguments, but got " +
                           std::to_string(a.size()));
     }
 }
 
-void RequiresOnlyLRArgumentsS(std::vector<Object*>& a, size_t l, size_t r) {
+void RequiresOnlyLRArgumentsS(std::span<Object*> a, size_t l, size_t r) {
     if (a.size() < l || a.size() > r) {
         throw SyntaxError("Requires only from " + std::to_string(l) + " to " + std::to_string(r) +
                           " arguments, but got " + std::to_string(a.size()));
     }
 }
 
-void RequiresMinimumXArguments(std::vector<Object*>& a, size_t x) {
+void RequiresMinimumXArguments(std::span<Object*> a, size_t x) {
     if (a.size() < x) {
         throw RuntimeError("Requires minimum " + std::to_string(x) + " arguments, but got " +
                            std::to_string(a.size()));
     }
 }
 
-void RequiresMinimumXArgumentsS(std::vector<Object*>& a, size_t x) {
+void RequiresMinimumXArgumentsS(std::span<Object*> a, size_t x) {
     if (a.size() < x) {
         throw SyntaxError("Requires minimum " + std::to_string(x) + " arguments, but got " +
                           std::to_string(a.size()));
     }
 }
 
-void RequiresValidIndex(std::vector<Object*>& a, size_t x) {
-    if (a.size() <= x) {
-        throw RuntimeError("Requires valid index");
-    }
-}
-
-void CalcVector(std::vector<Object*>& a, NameSpace* scope) {
+template <typename Arguments>
+void CalcVector(Arguments& a, NameSpace* scope) {
     for (auto& x : a) {
         x = Calc(x, scope);
     }
 }
 
-std::vector<Object*> CopyVector(std::vector<Object*>& a) {
-    auto vec = a;
-    for (auto& elem : vec) {
-        elem = Copy(elem);
-    }
-    return vec;
-}
-
-std::vector<Object*> CopyAndCalcVector(std::vector<Object*>& a, NameSpace* scope) {
-    auto vec = CopyVector(a);
-    CalcVector(vec, scope);
-    return vec;
-}
-
 Object* TrueObject() {
-    return Heap::Instance()->Make<Boolean>(true);
+    return Boolean::Instance(true);
 }
 
 Object* FalseObject() {
-    return Heap::Instance()->Make<Boolean>(false);
+    return Boolean::Instance(false);
 }
 
 Object* Condition(bool val) {
@@ -152,87 +545,108 @@ Object* Condition(bool val) {
     }
 }
 
-Object* Quote::operator()(Object* obj, [[maybe_unused]] NameSpace* scope) {
-    auto vec = ToVector(obj);
-    RequiresOnlyXArguments(vec, 1);
-    return vec.front();
+Object* Procedure::operator()(Object* obj, NameSpace* scope) {
+    ArgBuffer args(obj);
+    auto span = args.Span();
+    CalcVector(span, scope);
+    return Call(span);
+}
+
+Object* Procedure::Call(std::span<Object*> args) {
+    if (Profiler::IsEnabled() && !Heap::InTask()) {
+        ProfilerScope profiler_scope(this);
+        return Apply(args);
+    }
+    return Apply(args);
+}
+
+// The optimizer interns quoted data up front; forms it has not seen are interned here, and
+// rewritten unless other threads may be reading them.
+Object* Quote::operator()(Object* obj, NameSpace* scope) {
+    ArgBuffer args(obj);
+    RequiresOnlyXArguments(args.Span(), 1);
+    auto datum = args.Span().front();
+    if (datum == nullptr || datum->IsConstant()) {
+        return datum;
+    }
+    auto constant = scope->GetConstants().Intern(datum);
+    if (!Heap::InTask() && !Scheduler::HasAsyncWork()) {
+        As<Cell>(obj)->SetFirst(constant);
+    }
+    return constant;
 }
 
 // List operations
 
-Object* IsPair::operator()(Object* obj, NameSpace* scope) {
-    auto vec = ToVector(obj);
-    RequiresOnlyXArguments(vec, 1);
-    CalcVector(vec, scope);
-    return Condition(Is<Cell>(vec.front()));
+Object* IsPair::Apply(std::span<Object*> args) {
+    RequiresOnlyXArguments(args, 1);
+    return Condition(Is<Cell>(args.front()));
 }
 
-Object* IsNull::operator()(Object* obj, NameSpace* scope) {
-    auto vec = ToVector(obj);
-    RequiresOnlyXArguments(vec, 1);
-    CalcVector(vec, scope);
-    return Condition(vec.front() == nullptr);
+Object* IsNull::Apply(std::span<Object*> args) {
+    RequiresOnlyXArguments(args, 1);
+    return Condition(args.front() == nullptr);
 }
 
 bool IsListHelper(Object* obj) {
-    while (Is<Cell>(obj)) {
-        auto cell = As<Cell>(obj);
-        obj = cell->GetSecond();
+    auto slow = obj;
+    for (bool step = false; Is<Cell>(obj); step = !step) {
+        obj = As<Cell>(obj)->GetSecond();
+        if (step) {
+            slow = As<Cell>(slow)->GetSecond();
+            if (slow == obj) {
+                return false;
+            }
+        }
     }
     return obj == nullptr;
 }
 
-Object* IsList::operator()(Object* obj, NameSpace* scope) {
-    auto vec = ToVector(obj);
-    RequiresOnlyXArguments(vec, 1);
-    CalcVector(vec, scope);
-    return Condition(IsListHelper(vec.front()));
+Object* IsList::Apply(std::span<Object*> args) {
+    RequiresOnlyXArguments(args, 1);
+    return Condition(IsListHelper(args.front()));
 }
 
-Object* List::operator()(Object* obj, NameSpace* scope) {
-    auto vec = ToVector(obj);
-    CalcVector(vec, scope);
-    return FromVector(vec);
+Object* List::Apply(std::span<Object*> args) {
+    return FromVector(args);
 }
 
-Object* Cons::operator()(Object* obj, NameSpace* scope) {
-    auto vec = ToVector(obj);
-    RequiresOnlyXArguments(vec, 2);
-    CalcVector(vec, scope);
-    auto temp = Heap::Instance()->Make<Cell>(vec[0], vec[1]);
-    return temp;
+Object* Cons::Apply(std::span<Object*> args) {
+    RequiresOnlyXArguments(args, 2);
+    return Heap::Instance()->Make<Cell>(args[0], args[1]);
 }
 
-Object* Car::operator()(Object* obj, NameSpace* scope) {
-    auto vec = ToVector(obj);
-    RequiresOnlyXArguments(vec, 1);
-    CalcVector(vec, scope);
-    RequireType<Cell>(vec.front());
-    return As<Cell>(vec.front())->GetFirst();
+Object* Car::Apply(std::span<Object*> args) {
+    RequiresOnlyXArguments(args, 1);
+    RequireType<Cell>(args.front());
+    return As<Cell>(args.front())->GetFirst();
 }
 
-Object* Cdr::operator()(Object* obj, NameSpace* scope) {
-    auto vec = ToVector(obj);
-    RequiresOnlyXArguments(vec, 1);
-    CalcVector(vec, scope);
-    RequireType<Cell>(vec.front());
-    return As<Cell>(vec.front())->GetSecond();
+Object* Cdr::Apply(std::span<Object*> args) {
+    RequiresOnlyXArguments(args, 1);
+    RequireType<Cell>(args.front());
+    return As<Cell>(args.front())->GetSecond();
 }
 
-Object* ListRef::operator()(Object* obj, NameSpace* scope) {
-    auto args = ToVector(obj);
+Object* ListRef::Apply(std::span<Object*> args) {
     RequiresOnlyXArguments(args, 2);
-    CalcVector(args, scope);
-    auto vec = ToVector(args.front());
+    if (!IsListHelper(args.front())) {
+        throw RuntimeError("Must be proper list");
+    }
     RequireType<Number>(args[1]);
-    RequiresValidIndex(vec, As<Number>(args[1])->GetValue());
-    return vec[As<Number>(args[1])->GetValue()];
+    size_t index = As<Number>(args[1])->GetValue();
+    auto cur = args.front();
+    for (size_t i = 0; i < index && Is<Cell>(cur); ++i) {
+        cur = As<Cell>(cur)->GetSecond();
+    }
+    if (!Is<Cell>(cur)) {
+        throw RuntimeError("Requires valid index");
+    }
+    return As<Cell>(cur)->GetFirst();
 }
 
-Object* ListTail::operator()(Object* obj, NameSpace* scope) {
-    auto args = ToVector(obj);
+Object* ListTail::Apply(std::span<Object*> args) {
     RequiresOnlyXArguments(args, 2);
-    CalcVector(args, scope);
     RequireType<Number>(args[1]);
     auto steps = As<Number>(args[1])->GetValue();
     auto cur = args[0];
@@ -243,24 +657,214 @@ Object* ListTail::operator()(Object* obj, NameSpace* scope) {
     return cur;
 }
 
+// eqv?: the same object, or numbers or symbols with the same value.
+bool IsEqvHelper(Object* lhs, Object* rhs) {
+    if (lhs == rhs) {
+        return true;
+    }
+    if (Is<Number>(lhs) && Is<Number>(rhs)) {
+        return As<Number>(lhs)->GetValue() == As<Number>(rhs)->GetValue();
+    }
+    if (Is<Symbol>(lhs) && Is<Symbol>(rhs)) {
+        return As<Symbol>(lhs)->GetName() == As<Symbol>(rhs)->GetName();
+    }
+    return false;
+}
+
+// equal?: eqv? for everything but pairs, which are compared element by element.
+bool IsEqualHelper(Object* lhs, Object* rhs) {
+    while (Is<Cell>(lhs) && Is<Cell>(rhs) && lhs != rhs) {
+        if (!IsEqualHelper(As<Cell>(lhs)->GetFirst(), As<Cell>(rhs)->GetFirst())) {
+            return false;
+        }
+        lhs = As<Cell>(lhs)->GetSecond();
+        rhs = As<Cell>(rhs)->GetSecond();
+    }
+    return IsEqvHelper(lhs, rhs);
+}
+
+Procedure* RequireProcedure(Object* obj) {
+    RequireType<Procedure>(obj);
+    return As<Procedure>(obj);
+}
+
+// Elements of every list in args, cut to the length of the shortest one, by position.
+std::vector<std::vector<Object*>> Transpose(std::span<Object*> lists) {
+    std::vector<std::vector<Object*>> columns;
+    for (auto list : lists) {
+        columns.push_back(ToVector(list));
+    }
+    size_t size = columns.front().size();
+    for (auto& column : columns) {
+        size = std::min(size, column.size());
+    }
+    std::vector<std::vector<Object*>> rows(size, std::vector<Object*>(columns.size()));
+    for (size_t i = 0; i < size; ++i) {
+        for (size_t j = 0; j < columns.size(); ++j) {
+            rows[i][j] = columns[j][i];
+        }
+    }
+    return rows;
+}
+
+Object* Length::Apply(std::span<Object*> args) {
+    RequiresOnlyXArguments(args, 1);
+    return Heap::Instance()->Make<Number>(ToVector(args.front()).size());
+}
+
+// Every list but the last one is copied, the last one is shared with the result.
+Object* Append::Apply(std::span<Object*> args) {
+    if (args.empty()) {
+        return nullptr;
+    }
+    std::vector<Object*> items;
+    for (auto list : args.first(args.size() - 1)) {
+        auto elements = ToVector(list);
+        items.insert(items.end(), elements.begin(), elements.end());
+    }
+    auto res = args.back();
+    for (auto it = items.rbegin(); it != items.rend(); ++it) {
+        res = Heap::Instance()->Make<Cell>(*it, res);
+    }
+    return res;
+}
+
+Object* Reverse::Apply(std::span<Object*> args) {
+    RequiresOnlyXArguments(args, 1);
+    Object* res = nullptr;
+    for (auto item : ToVector(args.front())) {
+        res = Heap::Instance()->Make<Cell>(item, res);
+    }
+    return res;
+}
+
+Object* Map::Apply(std::span<Object*> args) {
+    RequiresMinimumXArguments(args, 2);
+    auto func = RequireProcedure(args.front());
+    auto rows = Transpose(args.subspan(1));
+    std::vector<Object*> results;
+    results.reserve(rows.size());
+    for (auto& row : rows) {
+        results.push_back(func->Call(row));
+    }
+    return FromVector(results);
+}
+
+Object* Filter::Apply(std::span<Object*> args) {
+    RequiresOnlyXArguments(args, 2);
+    auto pred = RequireProcedure(args.front());
+    std::vector<Object*> results;
+    for (auto item : ToVector(args.back())) {
+        if (ToBool(pred->Call({&item, 1}))) {
+            results.push_back(item);
+        }
+    }
+    return FromVector(results);
+}
+
+// (fold-left f init l ...) calls (f acc x ...) from the first elements on.
+Object* FoldLeft::Apply(std::span<Object*> args) {
+    RequiresMinimumXArguments(args, 3);
+    auto func = RequireProcedure(args.front());
+    auto acc = args[1];
+    for (auto& row : Transpose(args.subspan(2))) {
+        row.insert(row.begin(), acc);
+        acc = func->Call(row);
+    }
+    return acc;
+}
+
+// (fold-right f init l ...) calls (f x ... acc) from the last elements on.
+Object* FoldRight::Apply(std::span<Object*> args) {
+    RequiresMinimumXArguments(args, 3);
+    auto func = RequireProcedure(args.front());
+    auto acc = args[1];
+    auto rows = Transpose(args.subspan(2));
+    for (auto it = rows.rbegin(); it != rows.rend(); ++it) {
+        it->push_back(acc);
+        acc = func->Call(*it);
+    }
+    return acc;
+}
+
+template <bool (*Same)(Object*, Object*)>
+Object* FindEntry(std::span<Object*> args) {
+    RequiresOnlyXArguments(args, 2);
+    for (auto entry : ToVector(args.back())) {
+        RequireType<Cell>(entry);
+        if (Same(args.front(), As<Cell>(entry)->GetFirst())) {
+            return entry;
+        }
+    }
+    return FalseObject();
+}
+
+Object* Assq::Apply(std::span<Object*> args) {
+    return FindEntry<IsEqvHelper>(args);
+}
+
+Object* Assoc::Apply(std::span<Object*> args) {
+    return FindEntry<IsEqualHelper>(args);
+}
+
+Object* Member::Apply(std::span<Object*> args) {
+    RequiresOnlyXArguments(args, 2);
+    ToVector(args.back());
+    for (auto cur = args.back(); cur != nullptr; cur = As<Cell>(cur)->GetSecond()) {
+        if (IsEqualHelper(args.front(), As<Cell>(cur)->GetFirst())) {
+            return cur;
+        }
+    }
+    return FalseObject();
+}
+
+// Bottom-up merge sort. On ties the element from the left run goes first, which keeps the sort
+// stable, and nothing goes wrong with comparators that are not consistent.
+Object* Sort::Apply(std::span<Object*> args) {
+    RequiresOnlyXArguments(args, 2);
+    auto less = RequireProcedure(args.back());
+    auto items = ToVector(args.front());
+    std::vector<Object*> buffer(items.size());
+    for (size_t width = 1; width < items.size(); width *= 2) {
+        for (size_t begin = 0; begin < items.size(); begin += 2 * width) {
+            auto mid = std::min(begin + width, items.size());
+            auto end = std::min(begin + 2 * width, items.size());
+            auto left = begin, right = mid, out = begin;
+            while (left < mid && right < end) {
+                std::array<Object*, 2> pair = {items[right], items[left]};
+                buffer[out++] = ToBool(less->Call(pair)) ? items[right++] : items[left++];
+            }
+            while (left < mid) {
+                buffer[out++] = items[left++];
+            }
+            while (right < end) {
+                buffer[out++] = items[right++];
+            }
+        }
+        std::swap(items, buffer);
+    }
+    return FromVector(items);
+}
+
 // Number operations
 
-Object* IsNumber::operator()(Object* obj, NameSpace* scope) {
-    auto args = ToVector(obj);
+Object* IsNumber::Apply(std::span<Object*> args) {
     RequiresOnlyXArguments(args, 1);
-    CalcVector(args, scope);
     return Condition(Is<Number>(args.front()));
 }
 
-template <typename Functor>
-bool CalcNumberListToBool(std::vector<Object*>& vec, NameSpace* scope) {
+// Numeric templates accept any span of evaluated arguments. Calls with one or two arguments
+// instantiate them for fixed-extent spans, so the loops below are fully unrolled.
+
+template <typename Functor, typename Arguments>
+bool CalcNumberListToBool(Arguments vec) {
     if (vec.empty()) {
         return true;
     }
-    static auto func = Functor();
-    auto prev = CalcAndGet<Number>(vec.front(), scope);
+    auto func = Functor();
+    auto prev = Get<Number>(vec.front());
     for (size_t i = 1; i < vec.size(); ++i) {
-        auto cur = CalcAndGet<Number>(vec[i], scope);
+        auto cur = Get<Number>(vec[i]);
         if (!func(prev, cur)) {
             return false;
         }
@@ -269,10 +873,9 @@ bool CalcNumberListToBool(std::vector<Object*>& vec, NameSpace* scope) {
     return true;
 }
 
-template <typename Functor>
-int64_t CalcNumberListToInt(std::vector<Object*>& vec, NameSpace* scope, int64_t neutral) {
-    static auto func = Functor();
-    CalcVector(vec, scope);
+template <typename Functor, typename Arguments>
+int64_t CalcNumberListToInt(Arguments vec, int64_t neutral) {
+    auto func = Functor();
     auto result = neutral;
     for (auto& elem : vec) {
         auto cur = Get<Number>(elem);
@@ -281,10 +884,9 @@ int64_t CalcNumberListToInt(std::vector<Object*>& vec, NameSpace* scope, int64_t
     return result;
 }
 
-template <typename Functor>
-int64_t CalcIrrevNumberListToInt(std::vector<Object*>& vec, NameSpace* scope, int64_t neutral) {
-    static auto func = Functor();
-    CalcVector(vec, scope);
+template <typename Functor, typename Arguments>
+int64_t CalcIrrevNumberListToInt(Arguments vec, int64_t neutral) {
+    auto func = Functor();
     if (vec.size() == 1) {
         return func(neutral, Get<Number>(vec.front()));
     }
@@ -296,75 +898,88 @@ int64_t CalcIrrevNumberListToInt(std::vector<Object*>& vec, NameSpace* scope, in
     return result;
 }
 
-Object* EqualTo::operator()(Object* obj, NameSpace* scope) {
-    auto args = ToVector(obj);
-    return Condition(CalcNumberListToBool<std::equal_to<int64_t>>(args, scope));
+// Calls calc with args converted to a fixed-extent span for one- and two-argument calls.
+template <typename Calculator>
+auto WithArguments(std::span<Object*> args, size_t min_args, Calculator calc) {
+    if (args.size() == 2) {
+        return calc(std::span<Object*, 2>(args.data(), 2));
+    }
+    if (args.size() == 1) {
+        return calc(std::span<Object*, 1>(args.data(), 1));
+    }
+    RequiresMinimumXArguments(args, min_args);
+    return calc(args);
 }
 
-Object* Greater::operator()(Object* obj, NameSpace* scope) {
-    auto args = ToVector(obj);
-    return Condition(CalcNumberListToBool<std::greater<int64_t>>(args, scope));
+template <typename Functor>
+Object* CompareNumbers(std::span<Object*> args) {
+    return Condition(
+        WithArguments(args, 0, [](auto vec) { return CalcNumberListToBool<Functor>(vec); }));
 }
 
-Object* Less::operator()(Object* obj, NameSpace* scope) {
-    auto args = ToVector(obj);
-    return Condition(CalcNumberListToBool<std::less<int64_t>>(args, scope));
+template <typename Functor>
+Object* FoldNumbers(std::span<Object*> args, int64_t neutral, size_t min_args = 0) {
+    auto res = WithArguments(args, min_args, [neutral](auto vec) {
+        return CalcNumberListToInt<Functor>(vec, neutral);
+    });
+    return Heap::Instance()->Make<Number>(res);
 }
 
-Object* GreaterEqual::operator()(Object* obj, NameSpace* scope) {
-    auto args = ToVector(obj);
-    return Condition(CalcNumberListToBool<std::greater_equal<int64_t>>(args, scope));
+template <typename Functor>
+Object* FoldIrrevNumbers(std::span<Object*> args, int64_t neutral) {
+    auto res = WithArguments(args, 1, [neutral](auto vec) {
+        return CalcIrrevNumberListToInt<Functor>(vec, neutral);
+    });
+    return Heap::Instance()->Make<Number>(res);
 }
 
-Object* LessEqual::operator()(Object* obj, NameSpace* scope) {
-    auto args = ToVector(obj);
-    return Condition(CalcNumberListToBool<std::less_equal<int64_t>>(args, scope));
+Object* EqualTo::Apply(std::span<Object*> args) {
+    return CompareNumbers<std::equal_to<int64_t>>(args);
 }
 
-Object* Plus::operator()(Object* obj, NameSpace* scope) {
-    auto args = ToVector(obj);
-    auto res = CalcNumberListToInt<std::plus<int64_t>>(args, scope, 0);
-    return Heap::Instance()->Make<Number>(res);
+Object* Greater::Apply(std::span<Object*> args) {
+    return CompareNumbers<std::greater<int64_t>>(args);
 }
 
-Object* Minus::operator()(Object* obj, NameSpace* scope) {
-    auto args = ToVector(obj);
-    RequiresMinimumXArguments(args, 1);
-    auto res = CalcIrrevNumberListToInt<std::minus<int64_t>>(args, scope, 0);
-    return Heap::Instance()->Make<Number>(res);
+Object* Less::Apply(std::span<Object*> args) {
+    return CompareNumbers<std::less<int64_t>>(args);
 }
 
-Object* Multiplies::operator()(Object* obj, NameSpace* scope) {
-    auto args = ToVector(obj);
-    auto res = CalcNumberListToInt<std::multiplies<int64_t>>(args, scope, 1);
-    return Heap::Instance()->Make<Number>(res);
+Object* GreaterEqual::Apply(std::span<Object*> args) {
+    return CompareNumbers<std::greater_equal<int64_t>>(args);
 }
 
-Object* Divides::operator()(Object* obj, NameSpace* scope) {
-    auto args = ToVector(obj);
-    RequiresMinimumXArguments(args, 1);
-    auto res = CalcIrrevNumberListToInt<std::divides<int64_t>>(args, scope, 1);
-    return Heap::Instance()->Make<Number>(res);
+Object* LessEqual::Apply(std::span<Object*> args) {
+    return CompareNumbers<std::less_equal<int64_t>>(args);
 }
 
-Object* Max::operator()(Object* obj, NameSpace* scope) {
-    auto args = ToVector(obj);
-    RequiresMinimumXArguments(args, 1);
-    auto res = CalcNumberListToInt<MaxFunctor<int64_t>>(args, scope, LLONG_MIN);
-    return Heap::Instance()->Make<Number>(res);
+Object* Plus::Apply(std::span<Object*> args) {
+    return FoldNumbers<std::plus<int64_t>>(args, 0);
 }
 
-Object* Min::operator()(Object* obj, NameSpace* scope) {
-    auto args = ToVector(obj);
-    RequiresMinimumXArguments(args, 1);
-    auto res = CalcNumberListToInt<MinFunctor<int64_t>>(args, scope, LLONG_MAX);
-    return Heap::Instance()->Make<Number>(res);
+Object* Minus::Apply(std::span<Object*> args) {
+    return FoldIrrevNumbers<std::minus<int64_t>>(args, 0);
 }
 
-Object* Abs::operator()(Object* obj, NameSpace* scope) {
-    auto args = ToVector(obj);
+Object* Multiplies::Apply(std::span<Object*> args) {
+    return FoldNumbers<std::multiplies<int64_t>>(args, 1);
+}
+
+Object* Divides::Apply(std::span<Object*> args) {
+    return FoldIrrevNumbers<std::divides<int64_t>>(args, 1);
+}
+
+Object* Max::Apply(std::span<Object*> args) {
+    return FoldNumbers<MaxFunctor<int64_t>>(args, LLONG_MIN, 1);
+}
+
+Object* Min::Apply(std::span<Object*> args) {
+    return FoldNumbers<MinFunctor<int64_t>>(args, LLONG_MAX, 1);
+}
+
+Object* Abs::Apply(std::span<Object*> args) {
     RequiresOnlyXArguments(args, 1);
-    auto res = std::abs(CalcAndGet<Number>(args.front(), scope));
+    auto res = std::abs(Get<Number>(args.front()));
     return Heap::Instance()->Make<Number>(res);
 }
 
@@ -375,23 +990,20 @@ bool ToBool(Object* obj) {
     return true;
 }
 
-Object* IsBoolean::operator()(Object* obj, NameSpace* scope) {
-    auto args = ToVector(obj);
+Object* IsBoolean::Apply(std::span<Object*> args) {
     RequiresOnlyXArguments(args, 1);
-    CalcVector(args, scope);
     return Condition(Is<Boolean>(args.front()));
 }
 
-Object* Not::operator()(Object* obj, NameSpace* scope) {
-    auto args = ToVector(obj);
+Object* Not::Apply(std::span<Object*> args) {
     RequiresOnlyXArguments(args, 1);
-    CalcVector(args, scope);
     auto res = ToBool(args.front());
-    return Heap::Instance()->Make<Boolean>(!res);
+    return Condition(!res);
 }
 
 Object* And::operator()(Object* obj, NameSpace* scope) {
-    auto args = ToVector(obj);
+    ArgBuffer buffer(obj);
+    auto args = buffer.Span();
     if (args.empty()) {
         return TrueObject();
     }
@@ -405,7 +1017,8 @@ Object* And::operator()(Object* obj, NameSpace* scope) {
 }
 
 Object* Or::operator()(Object* obj, NameSpace* scope) {
-    auto args = ToVector(obj);
+    ArgBuffer buffer(obj);
+    auto args = buffer.Span();
     size_t temp = 0;
     for (auto& elem : args) {
         ++temp;
@@ -422,10 +1035,328 @@ Object* Or::operator()(Object* obj, NameSpace* scope) {
 
 // Advanced
 
+// Parallel tasks may only modify objects they allocated themselves.
+void RequireUnshared(Object* obj) {
+    if (Heap::InTask() && obj != nullptr && !obj->IsTaskLocal()) {
+        throw RuntimeError("Parallel tasks can not modify shared data");
+    }
+}
+
+// Asynchronous tasks may read any pair the main thread can reach, so it waits for them before
+// changing one.
+void RequireExclusivePair(Object* obj) {
+    if (obj->IsConstant()) {
+        throw RuntimeError("Quoted constants can not be modified");
+    }
+    RequireUnshared(obj);
+    if (!Heap::InTask() && Scheduler::HasAsyncWork()) {
+        Scheduler::Instance()->Quiesce();
+    }
+}
+
 void DefineHelper(Object* name, Object* obj, NameSpace* scope) {
-    scope->Set(Get<Symbol>(name), obj);
+    RequireType<Symbol>(name);
+    RequireUnshared(scope);
+    scope->Set(As<Symbol>(name), obj);
+}
+
+namespace {
+
+// Elements of a possibly improper list; tail gets what follows the last pair.
+std::vector<Object*> SplitList(Object* obj, Object*& tail) {
+    std::vector<Object*> items;
+    for (; Is<Cell>(obj); obj = As<Cell>(obj)->GetSecond()) {
+        items.push_back(As<Cell>(obj)->GetFirst());
+    }
+    tail = obj;
+    return items;
+}
+
+void MarkAssignedSymbols(Object* obj) {
+    if (Is<Symbol>(obj)) {
+        As<Symbol>(obj)->GetInfo()->assigned.store(true, std::memory_order_relaxed);
+    }
+    for (; Is<Cell>(obj); obj = As<Cell>(obj)->GetSecond()) {
+        MarkAssignedSymbols(As<Cell>(obj)->GetFirst());
+    }
+}
+
+}  // namespace
+
+// Top-level defines bind global names, which closures never capture.
+void MarkAssigned(Object* form, NameSpace* scope, bool top_level) {
+    if (Is<FoldedForm>(form)) {
+        MarkAssigned(As<FoldedForm>(form)->GetOriginal(), scope, top_level);
+        return;
+    }
+    if (!Is<Cell>(form) || form->IsConstant()) {
+        return;
+    }
+    auto head = As<Cell>(form)->GetFirst();
+    auto rest = As<Cell>(form)->GetSecond();
+    auto target = Is<Cell>(rest) ? As<Cell>(rest)->GetFirst() : nullptr;
+    Object* func = head;
+    if (Is<Symbol>(head)) {
+        auto slot = scope->Find(As<Symbol>(head));
+        func = slot == nullptr ? nullptr : *slot;
+    }
+    if (Is<Quote>(func)) {
+        return;
+    }
+    if ((Is<Define>(func) || Is<DefineMemoized>(func)) && !top_level) {
+        MarkAssignedSymbols(Is<Cell>(target) ? As<Cell>(target)->GetFirst() : target);
+    } else if (Is<Letrec>(func)) {
+        for (; Is<Cell>(target); target = As<Cell>(target)->GetSecond()) {
+            auto binding = As<Cell>(target)->GetFirst();
+            MarkAssignedSymbols(Is<Cell>(binding) ? As<Cell>(binding)->GetFirst() : nullptr);
+        }
+    } else if (Is<Macro>(func)) {
+        // The expansion may assign any of them.
+        MarkAssignedSymbols(rest);
+    }
+    bool begin = Is<Begin>(func) && top_level;
+    for (; Is<Cell>(form); form = As<Cell>(form)->GetSecond()) {
+        MarkAssigned(As<Cell>(form)->GetFirst(), scope, begin);
+    }
+}
+
+namespace {
+
+// Free variables of a lambda body. Binding forms are recognized as the creating scope sees
+// them; a name bound inside the body is not free there.
+class FreeVariables {
+public:
+    explicit FreeVariables(NameSpace* scope) : scope_(scope) {
+    }
+
+    void AddLambda(std::span<Object*> params, std::span<Object*> body) {
+        auto mark = bound_.size();
+        for (auto param : params) {
+            Bind(param);
+        }
+        AddBody(body);
+        bound_.resize(mark);
+    }
+
+    const std::vector<Symbol*>& Get() const {
+        return free_;
+    }
+
+private:
+    bool IsBound(const std::string& name) const {
+        return std::find(bound_.begin(), bound_.end(), name) != bound_.end();
+    }
+
+    void Bind(Object* obj) {
+        if (Is<Symbol>(obj)) {
+            bound_.push_back(As<Symbol>(obj)->GetName());
+        }
+    }
+
+    // Internal defines bind in the frame of the body.
+    void AddBody(std::span<Object*> forms) {
+        for (auto def : forms) {
+            if (Is<Cell>(def) && Is<Define>(Resolve(As<Cell>(def)->GetFirst())) &&
+                Is<Cell>(As<Cell>(def)->GetSecond())) {
+                auto target = As<Cell>(As<Cell>(def)->GetSecond())->GetFirst();
+                Bind(Is<Cell>(target) ? As<Cell>(target)->GetFirst() : target);
+            }
+        }
+        for (auto form : forms) {
+            Add(form);
+        }
+    }
+
+    void AddLambda(Object* params, Object* body) {
+        Object* rest;
+        auto names = SplitList(params, rest);
+        names.push_back(rest);
+        auto forms = SplitList(body, rest);
+        AddLambda(names, forms);
+    }
+
+    void AddBody(Object* forms) {
+        Object* rest;
+        auto items = SplitList(forms, rest);
+        AddBody(items);
+    }
+
+    Object* Resolve(Object* head) {
+        if (!Is<Symbol>(head)) {
+            return head;
+        }
+        if (IsBound(As<Symbol>(head)->GetName())) {
+            return nullptr;
+        }
+        auto slot = scope_->Find(As<Symbol>(head));
+        return slot == nullptr ? nullptr : *slot;
+    }
+
+    void Add(Object* form) {
+        if (Is<Symbol>(form)) {
+            auto symbol = As<Symbol>(form);
+            if (!IsBound(symbol->GetName()) &&
+                std::none_of(free_.begin(), free_.end(), [symbol](Symbol* other) {
+                    return other->GetName() == symbol->GetName();
+                })) {
+                free_.push_back(symbol);
+            }
+            return;
+        }
+        if (Is<FoldedForm>(form)) {
+            Add(As<FoldedForm>(form)->GetFolded());
+            Add(As<FoldedForm>(form)->GetOriginal());
+            return;
+        }
+        if (!Is<Cell>(form) || form->IsConstant()) {
+            return;
+        }
+        auto func = Resolve(As<Cell>(form)->GetFirst());
+        auto rest = As<Cell>(form)->GetSecond();
+        if (Is<Quote>(func)) {
+            return;
+        }
+        if (Is<Cell>(rest)) {
+            auto target = As<Cell>(rest)->GetFirst();
+            if (Is<CreateLambda>(func)) {
+                AddLambda(target, As<Cell>(rest)->GetSecond());
+                return;
+            }
+            if ((Is<Define>(func) || Is<DefineMemoized>(func)) && Is<Cell>(target)) {
+                Add(As<Cell>(target)->GetFirst());
+                AddLambda(As<Cell>(target)->GetSecond(), As<Cell>(rest)->GetSecond());
+                return;
+            }
+            if (Is<Let>(func) || Is<LetStar>(func) || Is<Letrec>(func) || Is<Do>(func)) {
+                AddBindingForm(func, rest);
+                return;
+            }
+        }
+        for (; Is<Cell>(form); form = As<Cell>(form)->GetSecond()) {
+            Add(As<Cell>(form)->GetFirst());
+        }
+    }
+
+    // args of (let [name] bindings body ...), (let* ...), (letrec ...) or (do specs exit
+    // command ...).
+    void AddBindingForm(Object* func, Object* args) {
+        auto mark = bound_.size();
+        if (Is<Let>(func) && Is<Symbol>(As<Cell>(args)->GetFirst())) {
+            Bind(As<Cell>(args)->GetFirst());
+            args = As<Cell>(args)->GetSecond();
+            if (!Is<Cell>(args)) {
+                bound_.resize(mark);
+                return;
+            }
+        }
+        std::vector<Cell*> bindings;
+        for (auto it = As<Cell>(args)->GetFirst(); Is<Cell>(it); it = As<Cell>(it)->GetSecond()) {
+            if (Is<Cell>(As<Cell>(it)->GetFirst())) {
+                bindings.push_back(As<Cell>(As<Cell>(it)->GetFirst()));
+            }
+        }
+        auto init = [](Cell* binding) {
+            auto rest = binding->GetSecond();
+            return Is<Cell>(rest) ? As<Cell>(rest)->GetFirst() : nullptr;
+        };
+        if (Is<LetStar>(func)) {
+            for (auto binding : bindings) {
+                Add(init(binding));
+                Bind(binding->GetFirst());
+            }
+        } else if (Is<Letrec>(func)) {
+            for (auto binding : bindings) {
+                Bind(binding->GetFirst());
+            }
+            for (auto binding : bindings) {
+                Add(init(binding));
+            }
+        } else {
+            for (auto binding : bindings) {
+                Add(init(binding));
+            }
+            for (auto binding : bindings) {
+                Bind(binding->GetFirst());
+            }
+            if (Is<Do>(func)) {
+                for (auto binding : bindings) {
+                    Add(binding->GetSecond());
+                }
+            }
+        }
+        if (Is<Do>(func)) {
+            for (auto it = As<Cell>(args)->GetSecond(); Is<Cell>(it);
+                 it = As<Cell>(it)->GetSecond()) {
+                Add(As<Cell>(it)->GetFirst());
+            }
+        } else {
+            AddBody(As<Cell>(args)->GetSecond());
+        }
+        bound_.resize(mark);
+    }
+
+    NameSpace* scope_;
+    std::vector<std::string> bound_;
+    std::vector<Symbol*> free_;
+};
+
+// Closure conversion: a lambda created in a local scope gets a frame of its own with just the
+// local variables its body refers to, on top of the global namespace, so that it does not keep
+// the frames it was created in alive. The frame binds the boxes of those variables, which the
+// defining frames and other closures share, so set! anywhere is seen everywhere. A lambda
+// referring to a name that may be rebound, that is not bound yet or that names a macro keeps
+// the whole chain instead.
+NameSpace* CaptureScope(std::vector<Object*>& arg_names, std::vector<Object*>& body,
+                        NameSpace* scope) {
+    auto global = scope->GetGlobal();
+    if (scope == global) {
+        return scope;
+    }
+    FreeVariables free(scope);
+    free.AddLambda(arg_names, body);
+    struct Capture {
+        Symbol* symbol;
+        NameSpace* owner;
+        Symbol* bound;
+    };
+    std::vector<Capture> captured;
+    for (auto symbol : free.Get()) {
+        auto assigned = symbol->GetInfo()->assigned.load(std::memory_order_relaxed);
+        auto [owner, bound] = scope->Resolve(symbol);
+        if (owner == nullptr) {
+            // Either bound globally later or a name that is not evaluated.
+            if (assigned) {
+                return scope;
+            }
+            continue;
+        }
+        auto value = *owner->Find(bound->GetName());
+        if (Is<Macro>(value) || (owner != global && assigned)) {
+            return scope;
+        }
+        if (owner != global) {
+            captured.push_back({symbol, owner, bound});
+        }
+    }
+    if (captured.empty()) {
+        return global;
+    }
+    std::vector<Box*> boxes;
+    for (auto [symbol, owner, bound] : captured) {
+        boxes.push_back(owner->Share(bound));
+        if (boxes.back() == nullptr) {
+            return scope;
+        }
+    }
+    auto frame = Heap::Instance()->Make<NameSpace>(global);
+    for (size_t i = 0; i < captured.size(); ++i) {
+        frame->Set(captured[i].symbol, boxes[i]);
+    }
+    return frame;
 }
 
+}  // namespace
+
 Object* CreateLambdaHelper(std::vector<Object*>& arg_names, std::vector<Object*>& body,
                            NameSpace* scope) {
     for (auto elem : arg_names) {
@@ -433,7 +1364,7 @@ Object* CreateLambdaHelper(std::vector<Object*>& arg_names, std::vector<Object*>
             throw SyntaxError("Symbols expected");
         }
     }
-    return Heap::Instance()->Make<Lambda>(arg_names, body, scope);
+    return Heap::Instance()->Make<Lambda>(arg_names, body, CaptureScope(arg_names, body, scope));
 }
 
 Object* Define::operator()(Object* obj, NameSpace* scope) {
@@ -441,7 +1372,11 @@ Object* Define::operator()(Object* obj, NameSpace* scope) {
     RequiresMinimumXArgumentsS(args, 2);
     if (Is<Symbol>(args.front())) {
         RequiresOnlyXArgumentsS(args, 2);
-        DefineHelper(args.front(), ::Copy(Calc(args.back(), scope)), scope);
+        auto value = Calc(args.back(), scope);
+        if (Is<Lambda>(value) && As<Lambda>(value)->GetName().empty()) {
+            As<Lambda>(value)->SetName(Get<Symbol>(args.front()));
+        }
+        DefineHelper(args.front(), value, scope);
         return args.front();
     } else if (IsListHelper(args.front())) {
 
@@ -451,7 +1386,10 @@ Object* Define::operator()(Object* obj, NameSpace* scope) {
 
         args.erase(args.begin());
 
-        DefineHelper(name, CreateLambdaHelper(arg_names, args, scope), scope);
+        auto lambda = CreateLambdaHelper(arg_names, args, scope);
+        RequireType<Symbol>(name);
+        As<Lambda>(lambda)->SetName(Get<Symbol>(name));
+        DefineHelper(name, lambda, scope);
 
         return name;
         // throw std::runtime_error("Not implemented");
@@ -460,53 +1398,412 @@ Object* Define::operator()(Object* obj, NameSpace* scope) {
     }
 }
 
-Object* IsSymbol::operator()(Object* obj, NameSpace* scope) {
-    auto args = ToVector(obj);
+Object* IsSymbol::Apply(std::span<Object*> args) {
     RequiresOnlyXArguments(args, 1);
-    CalcVector(args, scope);
     return Condition(Is<Symbol>(args.front()));
 }
 
 Object* Set::operator()(Object* obj, NameSpace* scope) {
-    auto args = ToVector(obj);
+    ArgBuffer buffer(obj);
+    auto args = buffer.Span();
     RequiresOnlyXArgumentsS(args, 2);
-    Object* prev = scope->Get(Get<Symbol>(args.front()));
-    scope->Get(Get<Symbol>(args.front())) = ::Copy(Calc(args.back(), scope));
+    RequireType<Symbol>(args.front());
+    auto name = As<Symbol>(args.front());
+    RequireUnshared(scope->Resolve(name).first);
+    Object* prev = scope->Get(name);
+    auto value = Calc(args.back(), scope);
+    auto lock = LockForUpdate();
+    auto& slot = scope->Get(name);
+    Heap::WriteBarrier(slot);
+    slot = value;
     return prev;
 }
 
-Object* SetCar::operator()(Object* obj, NameSpace* scope) {
-    auto args = ToVector(obj);
+Object* SetCar::Apply(std::span<Object*> args) {
     RequiresOnlyXArgumentsS(args, 2);
-
-    CalcVector(args, scope);
     RequireType<Cell>(args[0]);
+    RequireExclusivePair(args[0]);
     auto prev = As<Cell>(args.front())->GetFirst();
-    if (args.front() == args.back()) {
-        As<Cell>(args[0])->GetFirst() = args.back();
-    } else {
-        As<Cell>(args[0])->GetFirst() = ::Copy(args.back());
-    }
+    As<Cell>(args[0])->SetFirst(args.back());
     return prev;
 }
 
-Object* SetCdr::operator()(Object* obj, NameSpace* scope) {
-    auto args = ToVector(obj);
+Object* SetCdr::Apply(std::span<Object*> args) {
     RequiresOnlyXArgumentsS(args, 2);
-
-    CalcVector(args, scope);
     RequireType<Cell>(args[0]);
+    RequireExclusivePair(args[0]);
     auto prev = As<Cell>(args.front())->GetSecond();
-    if (args.front() == args.back()) {
-        As<Cell>(args[0])->GetSecond() = args.back();
+    As<Cell>(args[0])->SetSecond(args.back());
+    return prev;
+}
+
+// Appends a representation of obj that identifies its value to key. Returns false for
+// objects that are compared by identity and so cannot be cached by value.
+bool AppendMemoKey(Object* obj, std::string& key) {
+    if (obj == nullptr) {
+        key += 'e';
+    } else if (Is<Number>(obj)) {
+        auto value = As<Number>(obj)->GetValue();
+        key += 'n';
+        key.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    } else if (Is<Boolean>(obj)) {
+        key += As<Boolean>(obj)->GetValue() ? 't' : 'f';
+    } else if (Is<Symbol>(obj)) {
+        key += 's';
+        key += As<Symbol>(obj)->GetName();
+        key += '\0';
     } else {
-        As<Cell>(args[0])->GetSecond() = ::Copy(args.back());
+        return false;
     }
-    return prev;
+    return true;
 }
 
-Object* If::operator()(Object* obj, NameSpace* scope) {
+// func_ is applied directly: the profiler already charges calls of this procedure to it.
+Object* Memoized::Apply(std::span<Object*> args) {
+    std::string key;
+    for (auto arg : args) {
+        if (!AppendMemoKey(arg, key)) {
+            return func_->Apply(args);
+        }
+    }
+    {
+        std::lock_guard lock(mutex_);
+        if (auto it = index_.find(key); it != index_.end()) {
+            order_.splice(order_.begin(), order_, it->second);
+            return it->second->second;
+        }
+    }
+
+    // The lock is not held during the call, which may recurse into this procedure.
+    auto value = func_->Apply(args);
+    std::lock_guard lock(mutex_);
+    if (index_.contains(key)) {
+        return value;
+    }
+    order_.emplace_front(key, value);
+    index_[std::move(key)] = order_.begin();
+    if (order_.size() > capacity_) {
+        Heap::WriteBarrier(order_.back().second);
+        index_.erase(order_.back().first);
+        order_.pop_back();
+    }
+    return value;
+}
+
+// Marking does not hold the lock, as that would order it with the locks of nested caches.
+void Memoized::Mark() {
+    used_ = true;
+    std::vector<Object*> values;
+    {
+        std::lock_guard lock(mutex_);
+        values.reserve(order_.size());
+        for (auto& [key, value] : order_) {
+            values.push_back(value);
+        }
+    }
+    if (!func_->GetMark()) {
+        func_->Mark();
+    }
+    for (auto value : values) {
+        if (value != nullptr && !value->GetMark()) {
+            value->Mark();
+        }
+    }
+}
+
+Object* Memoize::Apply(std::span<Object*> args) {
+    RequiresOnlyLRArgumentsS(args, 1, 2);
+    RequireType<Procedure>(args.front());
+    size_t capacity = Memoized::kDefaultCapacity;
+    if (args.size() == 2) {
+        auto value = Get<Number>(args[1]);
+        if (value <= 0) {
+            throw RuntimeError("Memoization capacity must be positive");
+        }
+        capacity = value;
+    }
+    return Heap::Instance()->Make<Memoized>(As<Procedure>(args.front()), capacity);
+}
+
+Object* DefineMemoized::operator()(Object* obj, NameSpace* scope) {
     auto args = ToVector(obj);
+    RequiresMinimumXArgumentsS(args, 2);
+    if (!Is<Cell>(args.front()) || !IsListHelper(args.front())) {
+        throw SyntaxError("Invalid arguments for define-memoized");
+    }
+    auto arg_names = ToVector(args.front());
+    auto name = arg_names.front();
+    RequireType<Symbol>(name);
+    arg_names.erase(arg_names.begin());
+    args.erase(args.begin());
+
+    auto lambda = As<Lambda>(CreateLambdaHelper(arg_names, args, scope));
+    lambda->SetName(Get<Symbol>(name));
+    auto memoized = Heap::Instance()->Make<Memoized>(lambda, Memoized::kDefaultCapacity);
+    DefineHelper(name, memoized, scope);
+    return name;
+}
+
+// Chunk bounds only depend on the length of the list, never on the number of threads.
+constexpr size_t kParallelChunks = 64;
+
+std::vector<std::pair<size_t, size_t>> SplitIntoChunks(size_t size) {
+    std::vector<std::pair<size_t, size_t>> chunks;
+    auto count = std::min(size, kParallelChunks);
+    for (size_t i = 0; i < count; ++i) {
+        chunks.emplace_back(size * i / count, size * (i + 1) / count);
+    }
+    return chunks;
+}
+
+// Runs body(chunk, begin, end) for every chunk of [0, size) in parallel.
+template <typename Body>
+void ForEachChunk(size_t size, Body body) {
+    std::vector<std::function<void()>> tasks;
+    auto chunks = SplitIntoChunks(size);
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        tasks.emplace_back([&body, i, chunk = chunks[i]] { body(i, chunk.first, chunk.second); });
+    }
+    Scheduler::Instance()->RunAll(tasks);
+}
+
+std::vector<Object*> ParallelArguments(std::span<Object*> args, Procedure*& func) {
+    RequireType<Procedure>(args.front());
+    func = As<Procedure>(args.front());
+    if (!IsListHelper(args.back())) {
+        throw RuntimeError("Must be proper list");
+    }
+    return ToVector(args.back());
+}
+
+Object* ParMap::Apply(std::span<Object*> args) {
+    RequiresOnlyXArguments(args, 2);
+    Procedure* func;
+    auto items = ParallelArguments(args, func);
+    std::vector<Object*> results(items.size());
+    ForEachChunk(items.size(), [&](size_t, size_t begin, size_t end) {
+        for (auto i = begin; i < end; ++i) {
+            auto arg = items[i];
+            results[i] = func->Call({&arg, 1});
+        }
+    });
+    return FromVector(results);
+}
+
+Object* ParForEach::Apply(std::span<Object*> args) {
+    RequiresOnlyXArguments(args, 2);
+    Procedure* func;
+    auto items = ParallelArguments(args, func);
+    ForEachChunk(items.size(), [&](size_t, size_t begin, size_t end) {
+        for (auto i = begin; i < end; ++i) {
+            auto arg = items[i];
+            func->Call({&arg, 1});
+        }
+    });
+    return nullptr;
+}
+
+Object* ParReduce::Apply(std::span<Object*> args) {
+    RequiresOnlyXArguments(args, 3);
+    Procedure* func;
+    auto items = ParallelArguments(args, func);
+    std::vector<Object*> partial(SplitIntoChunks(items.size()).size());
+    ForEachChunk(items.size(), [&](size_t chunk, size_t begin, size_t end) {
+        auto acc = items[begin];
+        for (auto i = begin + 1; i < end; ++i) {
+            std::array<Object*, 2> pair = {acc, items[i]};
+            acc = func->Call(pair);
+        }
+        partial[chunk] = acc;
+    });
+    auto acc = args[1];
+    for (auto value : partial) {
+        std::array<Object*, 2> pair = {acc, value};
+        acc = func->Call(pair);
+    }
+    return acc;
+}
+
+void Future::Run() {
+    try {
+        result_ = Calc(expr_, scope_);
+    } catch (...) {
+        error_ = std::current_exception();
+    }
+    done_.store(true, std::memory_order_release);
+}
+
+Object* Future::Touch() {
+    if (!done_.load(std::memory_order_acquire)) {
+        Scheduler::Instance()->WaitUntil(
+            [this] { return done_.load(std::memory_order_acquire); });
+    }
+    if (error_) {
+        std::rethrow_exception(error_);
+    }
+    return result_;
+}
+
+Object* CreateFuture::operator()(Object* obj, NameSpace* scope) {
+    ArgBuffer args(obj);
+    RequiresOnlyXArgumentsS(args.Span(), 1);
+    auto future = Heap::Instance()->Make<Future>(args.Span().front(), scope);
+    Scheduler::Instance()->Spawn([future] { future->Run(); });
+    return future;
+}
+
+// Touching anything but a future returns it as is.
+Object* Touch::Apply(std::span<Object*> args) {
+    RequiresOnlyXArguments(args, 1);
+    if (auto future = As<Future>(args.front())) {
+        return future->Touch();
+    }
+    return args.front();
+}
+
+// The promise is not locked while expr is evaluated, so expr may force it again; the value
+// that is stored first wins. Parallel tasks do not store values in shared promises.
+Object* Promise::Force() {
+    Object* expr;
+    NameSpace* scope;
+    {
+        std::lock_guard lock(mutex_);
+        if (forced_) {
+            return value_;
+        }
+        expr = expr_;
+        scope = scope_;
+    }
+    auto value = Calc(expr, scope);
+    if (Heap::InTask() && !IsTaskLocal()) {
+        return value;
+    }
+    std::lock_guard lock(mutex_);
+    if (!forced_) {
+        value_ = value;
+        forced_ = true;
+        Heap::WriteBarrier(std::exchange(expr_, nullptr));
+        Heap::WriteBarrier(std::exchange(scope_, nullptr));
+    }
+    return value_;
+}
+
+void Promise::Resolve(Object* value) {
+    std::lock_guard lock(mutex_);
+    Heap::WriteBarrier(std::exchange(value_, value));
+    forced_ = true;
+    Heap::WriteBarrier(std::exchange(expr_, nullptr));
+    Heap::WriteBarrier(std::exchange(scope_, nullptr));
+}
+
+void Promise::Mark() {
+    used_ = true;
+    std::array<Object*, 3> objs;
+    {
+        std::lock_guard lock(mutex_);
+        objs = {expr_, scope_, value_};
+    }
+    for (auto obj : objs) {
+        if (obj != nullptr && !obj->GetMark()) {
+            obj->Mark();
+        }
+    }
+}
+
+Object* Delay::operator()(Object* obj, NameSpace* scope) {
+    ArgBuffer args(obj);
+    RequiresOnlyXArgumentsS(args.Span(), 1);
+    return Heap::Instance()->Make<Promise>(args.Span().front(), scope);
+}
+
+// Forcing anything but a promise returns it as is.
+Object* Force::Apply(std::span<Object*> args) {
+    RequiresOnlyXArguments(args, 1);
+    if (auto promise = As<Promise>(args.front())) {
+        return promise->Force();
+    }
+    return args.front();
+}
+
+Object* MakePromise::Apply(std::span<Object*> args) {
+    RequiresOnlyXArguments(args, 1);
+    if (Is<Promise>(args.front())) {
+        return args.front();
+    }
+    auto promise = Heap::Instance()->Make<Promise>();
+    promise->Resolve(args.front());
+    return promise;
+}
+
+Object* ConsStream::operator()(Object* obj, NameSpace* scope) {
+    ArgBuffer buffer(obj);
+    auto args = buffer.Span();
+    RequiresOnlyXArgumentsS(args, 2);
+    auto head = Calc(args.front(), scope);
+    return Heap::Instance()->Make<Cell>(head, Heap::Instance()->Make<Promise>(args.back(), scope));
+}
+
+Object* StreamCar::Apply(std::span<Object*> args) {
+    RequiresOnlyXArguments(args, 1);
+    RequireType<Cell>(args.front());
+    return As<Cell>(args.front())->GetFirst();
+}
+
+Object* StreamCdr::Apply(std::span<Object*> args) {
+    RequiresOnlyXArguments(args, 1);
+    RequireType<Cell>(args.front());
+    auto tail = As<Cell>(args.front())->GetSecond();
+    RequireType<Promise>(tail);
+    return As<Promise>(tail)->Force();
+}
+
+Object* MakePair(const std::string& key, Object* value) {
+    return Heap::Instance()->Make<Cell>(Heap::Instance()->Make<Symbol>(key), value);
+}
+
+Object* MakeNumberPair(const std::string& key, uint64_t value) {
+    return MakePair(key, Heap::Instance()->Make<Number>(value));
+}
+
+Object* GcStats::Apply(std::span<Object*> args) {
+    RequiresOnlyXArguments(args, 0);
+    auto stats = Heap::Instance()->GetStats();
+
+    std::vector<Object*> by_kind;
+    for (size_t i = 0; i < stats.allocations_by_kind.size(); ++i) {
+        by_kind.push_back(MakeNumberPair(ObjectKindName(static_cast<ObjectKind>(i)),
+                                         stats.allocations_by_kind[i]));
+    }
+    std::vector<Object*> pauses;
+    for (size_t i = 0; i < stats.pause_histogram.size(); ++i) {
+        uint64_t bound = 1ull << i;
+        pauses.push_back(MakeNumberPair("<" + std::to_string(bound) + "us",
+                                        stats.pause_histogram[i]));
+    }
+
+    std::vector<Object*> res = {
+        MakeNumberPair("allocations", stats.allocations),
+        MakeNumberPair("bytes-allocated", stats.bytes_allocated),
+        MakePair("allocations-by-type", FromVector(by_kind)),
+        MakeNumberPair("collections", stats.collections),
+        MakeNumberPair("objects-freed", stats.objects_freed),
+        MakeNumberPair("bytes-freed", stats.bytes_freed),
+        MakeNumberPair("survivors", stats.survivors),
+        MakeNumberPair("live-objects", stats.live_objects),
+        MakeNumberPair("live-bytes", stats.live_bytes),
+        MakeNumberPair("peak-objects", stats.peak_objects),
+        MakeNumberPair("peak-bytes", stats.peak_bytes),
+        MakeNumberPair("total-pause-us", stats.total_pause_ns / 1000),
+        MakeNumberPair("max-pause-us", stats.max_pause_ns / 1000),
+        MakeNumberPair("background-us", stats.total_background_ns / 1000),
+        MakePair("pause-histogram", FromVector(pauses)),
+    };
+    return FromVector(res);
+}
+
+Object* If::operator()(Object* obj, NameSpace* scope) {
+    ArgBuffer buffer(obj);
+    auto args = buffer.Span();
     RequiresOnlyLRArgumentsS(args, 2, 3);
     args.front() = Calc(args.front(), scope);
     if (ToBool(args.front())) {
@@ -518,26 +1815,78 @@ Object* If::operator()(Object* obj, NameSpace* scope) {
     }
 }
 
-Object* Lambda::operator()(Object* obj, NameSpace* scope) {
-    auto args = ToVector(obj);
-    RequiresOnlyXArguments(args, arg_names_.size());
+// Evaluates forms in order and returns the value of the last one.
+Object* EvalBody(std::span<Object*> forms, NameSpace* scope) {
+    Object* result = nullptr;
+    for (auto form : forms) {
+        result = Calc(form, scope);
+    }
+    return result;
+}
 
-    // args = CopyAndCalcVector(args, scope);
-    CalcVector(args, scope);
-    auto newscope = scope_;
+// Guards native_ against the collector, which reads it while marking.
+std::mutex native_mutex;
+
+// Every call gets a fresh frame on top of the defining scope. Quoted literals in the body are
+// constants, so the body is evaluated as it is.
+Object* Lambda::Apply(std::span<Object*> args) {
+    auto& budget = scope_->GetBudget();
+    budget.Step();
+    // Native code skips the profiler, so profiled runs stay interpreted. Parallel tasks only
+    // run code that was compiled before.
+    if (Jit::IsEnabled() && !Profiler::IsEnabled()) {
+        // Only the main thread changes native_, and only while no asynchronous task reads it.
+        bool in_task = Heap::InTask() || Scheduler::HasAsyncWork();
+        if (!in_task && native_ == nullptr && ++calls_ == Jit::kHotThreshold) {
+            auto native = Jit::Compile(this);
+            std::lock_guard lock(native_mutex);
+            native_ = std::move(native);
+        }
+        if (native_ != nullptr && native_->IsValid()) {
+            if (auto res = native_->Run(args, budget)) {
+                return res;
+            }
+        } else if (native_ != nullptr && !in_task) {
+            std::unique_lock lock(native_mutex);
+            auto native = std::move(native_);
+            lock.unlock();
+            calls_ = 0;
+        }
+    }
+    RequiresOnlyXArguments(args, arg_names_.size());
+    // Unless the body captures the frame, nothing points to it once the call returns.
+    auto frame = Heap::Instance()->MakeRegional<NameSpace>(scope_);
     for (size_t i = 0; i < arg_names_.size(); ++i) {
-        DefineHelper(arg_names_[i], args[i], newscope);
+        frame->Set(As<Symbol>(arg_names_[i]), args[i]);
     }
-    auto copy_body = CopyAndCalcVector(body_, newscope);
-    return copy_body.back();
+    return EvalBody(body_, frame.get());
 }
 
 Object* Lambda::Copy() {
-    auto res = Heap::Instance()->Make<Lambda>();
-    res->arg_names_ = CopyVector(arg_names_);
-    res->body_ = CopyVector(body_);
-    res->scope_ = As<NameSpace>(scope_->Copy());
-    return res;
+    return Heap::Instance()->Make<Lambda>(*this);
+}
+
+void Lambda::Mark() {
+    used_ = true;
+    for (auto& e : arg_names_) {
+        if (e != nullptr && !e->GetMark()) {
+            e->Mark();
+        }
+    }
+    for (auto& e : body_) {
+        if (e != nullptr && !e->GetMark()) {
+            e->Mark();
+        }
+    }
+    if (scope_ != nullptr && !scope_->GetMark()) {
+        scope_->Mark();
+    }
+    std::unique_lock lock(native_mutex);
+    auto native = native_;
+    lock.unlock();
+    if (native != nullptr) {
+        native->Mark();
+    }
 }
 
 Object* CreateLambda::operator()(Object* obj, NameSpace* scope) {
@@ -548,3 +1897,638 @@ Object* CreateLambda::operator()(Object* obj, NameSpace* scope) {
     RequiresMinimumXArgumentsS(body, 1);
     return CreateLambdaHelper(args, body, scope);
 }
+
+// Binding forms evaluate their bodies in regional frames (see NameSpace::Escape), so they
+// allocate no closures, and frames that are not captured are freed right away.
+
+bool IsKeyword(Object* obj, const char* name) {
+    return Is<Symbol>(obj) && As<Symbol>(obj)->Unaliased()->GetName() == name;
+}
+
+// Checks a binding (name init) or, with a step allowed, (name init step) and returns the name.
+Symbol* ParseBinding(std::span<Object*> parts, bool step = false) {
+    if (parts.size() < 2 || parts.size() > (step ? 3u : 2u) || !Is<Symbol>(parts[0])) {
+        throw SyntaxError("Invalid binding");
+    }
+    return As<Symbol>(parts[0]);
+}
+
+// Calls body(name, init) for every binding of a let-like form, in order.
+template <typename F>
+void ForEachBinding(Object* bindings, F&& body) {
+    if (!IsListHelper(bindings)) {
+        throw SyntaxError("Invalid bindings");
+    }
+    for (; bindings != nullptr; bindings = As<Cell>(bindings)->GetSecond()) {
+        auto binding = As<Cell>(bindings)->GetFirst();
+        if (!IsListHelper(binding)) {
+            throw SyntaxError("Invalid binding");
+        }
+        ArgBuffer parts(binding);
+        auto name = ParseBinding(parts.Span());
+        body(name, parts.Span()[1]);
+    }
+}
+
+Object* Begin::operator()(Object* obj, NameSpace* scope) {
+    ArgBuffer forms(obj);
+    return EvalBody(forms.Span(), scope);
+}
+
+Object* EvalList(Object* forms, NameSpace* scope);
+
+Object* SelectCondBody(Object* clauses, NameSpace* scope, Object*& value);
+
+bool EvalTail(Object* form, NameSpace* scope, Lambda* loop, std::vector<Object*>& next,
+              Object*& result);
+
+bool EvalTailList(Object* forms, NameSpace* scope, Lambda* loop, std::vector<Object*>& next,
+                  Object*& result) {
+    result = nullptr;
+    if (forms == nullptr) {
+        return false;
+    }
+    for (; As<Cell>(forms)->GetSecond() != nullptr; forms = As<Cell>(forms)->GetSecond()) {
+        Calc(As<Cell>(forms)->GetFirst(), scope);
+    }
+    return EvalTail(As<Cell>(forms)->GetFirst(), scope, loop, next, result);
+}
+
+// Evaluates a form in tail position of a named let body. A call to the loop procedure there
+// only evaluates its arguments into next and returns true, so that the let jumps to its next
+// iteration instead of recursing. Tail positions are followed through if, cond, when, unless,
+// begin and macro uses; everything else is evaluated as usual, with the value stored in result.
+bool EvalTail(Object* form, NameSpace* scope, Lambda* loop, std::vector<Object*>& next,
+              Object*& result) {
+    if (Is<FoldedForm>(form)) {
+        auto folded = As<FoldedForm>(form);
+        if (folded->IsValid() && folded->GetFolded() != nullptr) {
+            return EvalTail(folded->GetFolded(), scope, loop, next, result);
+        }
+        form = folded->IsValid() ? nullptr : folded->GetOriginal();
+    }
+    if (!Is<Cell>(form)) {
+        result = form == nullptr ? nullptr : Calc(form, scope);
+        return false;
+    }
+    auto func = Calc(As<Cell>(form)->GetFirst(), scope);
+    auto args = As<Cell>(form)->GetSecond();
+    if (func == loop) {
+        ArgBuffer values(args);
+        next.clear();
+        for (auto value : values.Span()) {
+            next.push_back(Calc(value, scope));
+        }
+        return true;
+    }
+    if (Is<If>(func)) {
+        ArgBuffer buffer(args);
+        auto parts = buffer.Span();
+        RequiresOnlyLRArgumentsS(parts, 2, 3);
+        if (ToBool(Calc(parts[0], scope))) {
+            return EvalTail(parts[1], scope, loop, next, result);
+        }
+        return EvalTail(parts.size() == 3 ? parts[2] : nullptr, scope, loop, next, result);
+    }
+    if (Is<Cond>(func)) {
+        auto body = SelectCondBody(args, scope, result);
+        return body != nullptr && EvalTailList(body, scope, loop, next, result);
+    }
+    if ((Is<When>(func) || Is<Unless>(func)) && IsListHelper(args) && args != nullptr &&
+        As<Cell>(args)->GetSecond() != nullptr) {
+        if (ToBool(Calc(As<Cell>(args)->GetFirst(), scope)) != Is<When>(func)) {
+            result = nullptr;
+            return false;
+        }
+        return EvalTailList(As<Cell>(args)->GetSecond(), scope, loop, next, result);
+    }
+    if (Is<Begin>(func) && IsListHelper(args)) {
+        return EvalTailList(args, scope, loop, next, result);
+    }
+    if (Is<Macro>(func)) {
+        auto expansion = As<Macro>(func)->ExpandInPlace(As<Cell>(form), scope);
+        return EvalTail(expansion, scope, loop, next, result);
+    }
+    if (!Is<Functor>(func)) {
+        throw RuntimeError("cant calc this cell");
+    }
+    result = (*As<Functor>(func))(args, scope);
+    return false;
+}
+
+// (let name ((n init) ...) body ...) binds name to a procedure running the body, in a frame of
+// its own, and calls it with the initial values. Calls to name in tail position of the body
+// jump to the next iteration; the procedure is only called for other uses of it.
+Object* NamedLet(std::span<Object*> args, NameSpace* scope) {
+    RequiresMinimumXArgumentsS(args, 3);
+    std::vector<Object*> params, values;
+    ForEachBinding(args[1], [&](Symbol* name, Object* init) {
+        params.push_back(name);
+        values.push_back(Calc(init, scope));
+    });
+    std::vector<Object*> body(args.begin() + 2, args.end());
+    auto frame = Heap::Instance()->MakeRegional<NameSpace>(scope);
+    // The procedure refers to its own name, which is bound before it is created, so that it
+    // captures the name like any other variable rather than keeping the frames alive.
+    auto name = As<Symbol>(args[0]);
+    frame->Set(name, nullptr);
+    auto loop = As<Lambda>(CreateLambdaHelper(params, body, frame.get()));
+    loop->SetName(name->GetName());
+    *frame->Find(name->GetName()) = loop;
+
+    std::vector<Object*> next;
+    auto iteration = Heap::Instance()->MakeRegional<NameSpace>(frame.get());
+    while (true) {
+        RequiresOnlyXArguments(values, params.size());
+        for (size_t i = 0; i < params.size(); ++i) {
+            iteration->Set(As<Symbol>(params[i]), values[i]);
+        }
+        for (size_t i = 0; i + 1 < body.size(); ++i) {
+            Calc(body[i], iteration.get());
+        }
+        Object* result;
+        if (!EvalTail(body.back(), iteration.get(), loop, next, result)) {
+            return result;
+        }
+        values.swap(next);
+        scope->GetBudget().Step();
+        if (!iteration->IsRegional()) {
+            iteration = Heap::Instance()->MakeRegional<NameSpace>(frame.get());
+        }
+    }
+}
+
+Object* Let::operator()(Object* obj, NameSpace* scope) {
+    ArgBuffer buffer(obj);
+    auto args = buffer.Span();
+    RequiresMinimumXArgumentsS(args, 2);
+    if (Is<Symbol>(args.front())) {
+        return NamedLet(args, scope);
+    }
+    ArgBuffer values;
+    ForEachBinding(args.front(), [&](Symbol*, Object* init) {
+        values.PushBack(Calc(init, scope));
+    });
+    auto frame = Heap::Instance()->MakeRegional<NameSpace>(scope);
+    size_t i = 0;
+    ForEachBinding(args.front(), [&](Symbol* name, Object*) {
+        frame->Set(name, values.Span()[i++]);
+    });
+    return EvalBody(args.subspan(1), frame.get());
+}
+
+// Every init sees the bindings before it. They share one frame: a later binding of the same
+// name replaces the earlier one, which is what nested lets would show.
+Object* LetStar::operator()(Object* obj, NameSpace* scope) {
+    ArgBuffer buffer(obj);
+    auto args = buffer.Span();
+    RequiresMinimumXArgumentsS(args, 2);
+    auto frame = Heap::Instance()->MakeRegional<NameSpace>(scope);
+    ForEachBinding(args.front(), [&](Symbol* name, Object* init) {
+        frame->Set(name, Calc(init, frame.get()));
+    });
+    return EvalBody(args.subspan(1), frame.get());
+}
+
+// letrec*: every name is bound, to the empty list until its init is evaluated, before the
+// inits are evaluated in order.
+Object* Letrec::operator()(Object* obj, NameSpace* scope) {
+    ArgBuffer buffer(obj);
+    auto args = buffer.Span();
+    RequiresMinimumXArgumentsS(args, 2);
+    auto frame = Heap::Instance()->MakeRegional<NameSpace>(scope);
+    ForEachBinding(args.front(), [&](Symbol* name, Object*) { frame->Set(name, nullptr); });
+    ForEachBinding(args.front(), [&](Symbol* name, Object* init) {
+        frame->Set(name, Calc(init, frame.get()));
+    });
+    return EvalBody(args.subspan(1), frame.get());
+}
+
+// Evaluates the forms of a list in order and returns the value of the last one.
+Object* EvalList(Object* forms, NameSpace* scope) {
+    Object* result = nullptr;
+    for (; forms != nullptr; forms = As<Cell>(forms)->GetSecond()) {
+        result = Calc(As<Cell>(forms)->GetFirst(), scope);
+    }
+    return result;
+}
+
+// Clauses are (test body ...), (test => receiver), (test) and a final (else body ...).
+// Returns the body of the clause that applies, or nullptr with the value of the form in value
+// if there is no body to evaluate.
+Object* SelectCondBody(Object* clauses, NameSpace* scope, Object*& value) {
+    value = nullptr;
+    ArgBuffer buffer(clauses);
+    for (auto clause : buffer.Span()) {
+        if (!Is<Cell>(clause) || !IsListHelper(clause)) {
+            throw SyntaxError("Invalid cond clause");
+        }
+        auto test = As<Cell>(clause)->GetFirst();
+        auto body = As<Cell>(clause)->GetSecond();
+        if (IsKeyword(test, "else")) {
+            return body;
+        }
+        value = Calc(test, scope);
+        if (!ToBool(value)) {
+            continue;
+        }
+        if (body != nullptr && IsKeyword(As<Cell>(body)->GetFirst(), "=>")) {
+            ArgBuffer parts(clause);
+            RequiresOnlyXArgumentsS(parts.Span(), 3);
+            auto receiver = Calc(parts.Span()[2], scope);
+            RequireType<Procedure>(receiver);
+            value = As<Procedure>(receiver)->Call({&value, 1});
+            return nullptr;
+        }
+        return body;
+    }
+    value = nullptr;
+    return nullptr;
+}
+
+Object* Cond::operator()(Object* obj, NameSpace* scope) {
+    Object* value;
+    auto body = SelectCondBody(obj, scope, value);
+    return body == nullptr ? value : EvalList(body, scope);
+}
+
+// Clauses are ((datum ...) body ...) and a final (else body ...); data are compared with eqv?.
+Object* Case::operator()(Object* obj, NameSpace* scope) {
+    ArgBuffer buffer(obj);
+    auto args = buffer.Span();
+    RequiresMinimumXArgumentsS(args, 1);
+    auto key = Calc(args.front(), scope);
+    for (auto clause : args.subspan(1)) {
+        if (!Is<Cell>(clause) || !IsListHelper(clause)) {
+            throw SyntaxError("Invalid case clause");
+        }
+        ArgBuffer parts(clause);
+        auto data = parts.Span().front();
+        if (IsKeyword(data, "else")) {
+            return EvalBody(parts.Span().subspan(1), scope);
+        }
+        if (!IsListHelper(data)) {
+            throw SyntaxError("Invalid case clause");
+        }
+        for (; data != nullptr; data = As<Cell>(data)->GetSecond()) {
+            auto datum = As<Cell>(data)->GetFirst();
+            if (IsEqvHelper(key, Is<Symbol>(datum) ? As<Symbol>(datum)->Unaliased() : datum)) {
+                return EvalBody(parts.Span().subspan(1), scope);
+            }
+        }
+    }
+    return nullptr;
+}
+
+template <bool Expected>
+Object* EvalWhen(Object* obj, NameSpace* scope) {
+    ArgBuffer buffer(obj);
+    auto args = buffer.Span();
+    RequiresMinimumXArgumentsS(args, 2);
+    if (ToBool(Calc(args.front(), scope)) != Expected) {
+        return nullptr;
+    }
+    return EvalBody(args.subspan(1), scope);
+}
+
+Object* When::operator()(Object* obj, NameSpace* scope) {
+    return EvalWhen<true>(obj, scope);
+}
+
+Object* Unless::operator()(Object* obj, NameSpace* scope) {
+    return EvalWhen<false>(obj, scope);
+}
+
+// (do ((name init step) ...) (test result ...) command ...). Each iteration binds the names in
+// a fresh frame; as long as nothing captured the frame of the previous iteration, that one is
+// reused instead.
+Object* Do::operator()(Object* obj, NameSpace* scope) {
+    ArgBuffer buffer(obj);
+    auto args = buffer.Span();
+    RequiresMinimumXArgumentsS(args, 2);
+    if (!IsListHelper(args.front())) {
+        throw SyntaxError("Invalid bindings");
+    }
+    ArgBuffer specs(args.front());
+    std::vector<Symbol*> names;
+    std::vector<Object*> steps;
+    ArgBuffer values;
+    for (auto spec : specs.Span()) {
+        if (!IsListHelper(spec)) {
+            throw SyntaxError("Invalid binding");
+        }
+        ArgBuffer parts(spec);
+        names.push_back(ParseBinding(parts.Span(), true));
+        steps.push_back(parts.Size() == 3 ? parts.Span()[2] : nullptr);
+        values.PushBack(Calc(parts.Span()[1], scope));
+    }
+    if (!Is<Cell>(args[1]) || !IsListHelper(args[1])) {
+        throw SyntaxError("Invalid do exit clause");
+    }
+    ArgBuffer exit(args[1]);
+    auto commands = args.subspan(2);
+
+    auto frame = Heap::Instance()->MakeRegional<NameSpace>(scope);
+    while (true) {
+        for (size_t i = 0; i < names.size(); ++i) {
+            frame->Set(names[i], values.Span()[i]);
+        }
+        if (ToBool(Calc(exit.Span().front(), frame.get()))) {
+            return EvalBody(exit.Span().subspan(1), frame.get());
+        }
+        EvalBody(commands, frame.get());
+        for (size_t i = 0; i < names.size(); ++i) {
+            values.Span()[i] = Calc(steps[i] != nullptr ? steps[i] : names[i], frame.get());
+        }
+        scope->GetBudget().Step();
+        if (!frame->IsRegional()) {
+            frame = Heap::Instance()->MakeRegional<NameSpace>(scope);
+        }
+    }
+}
+
+// Macros
+
+namespace {
+
+// What a pattern variable matched: a form, or for a variable under an ellipsis one match per
+// repetition.
+struct MacroMatch {
+    Object* form = nullptr;
+    bool repeated = false;
+    std::vector<MacroMatch> items;
+};
+
+using MacroBindings = std::unordered_map<std::string, MacroMatch>;
+
+bool IsLiteralOf(const std::vector<Object*>& literals, Symbol* symbol) {
+    return std::any_of(literals.begin(), literals.end(), [symbol](Object* literal) {
+        return As<Symbol>(literal)->Unaliased()->GetName() == symbol->Unaliased()->GetName();
+    });
+}
+
+void CollectPatternVariables(Object* pattern, const std::vector<Object*>& literals,
+                             std::unordered_set<std::string>& vars) {
+    while (Is<Cell>(pattern)) {
+        CollectPatternVariables(As<Cell>(pattern)->GetFirst(), literals, vars);
+        pattern = As<Cell>(pattern)->GetSecond();
+    }
+    if (Is<Symbol>(pattern) && !IsKeyword(pattern, "...") && !IsKeyword(pattern, "_") &&
+        !IsLiteralOf(literals, As<Symbol>(pattern))) {
+        vars.insert(As<Symbol>(pattern)->GetName());
+    }
+}
+
+// Matches one syntax rule and instantiates its template. Every symbol of the template that is
+// not a pattern variable is renamed: it gets a fresh name per expansion, with a '#' the reader
+// never produces in symbols, so that it neither captures nor is captured by a binding of the
+// use site (see Symbol). Quoted data keep their symbols.
+class MacroExpander {
+public:
+    explicit MacroExpander(Macro* macro) : macro_(macro) {
+    }
+
+    bool Match(Object* pattern, Object* form, MacroBindings& binds) const {
+        if (Is<Symbol>(pattern)) {
+            if (IsKeyword(pattern, "_")) {
+                return true;
+            }
+            if (IsLiteralOf(macro_->GetLiterals(), As<Symbol>(pattern))) {
+                return Is<Symbol>(form) && IsLiteralOf({pattern}, As<Symbol>(form));
+            }
+            binds[As<Symbol>(pattern)->GetName()] = MacroMatch{form, false, {}};
+            return true;
+        }
+        if (!Is<Cell>(pattern)) {
+            return Is<Number>(pattern) ? IsEqvHelper(pattern, form) : pattern == form;
+        }
+
+        Object* pattern_tail;
+        auto parts = SplitList(pattern, pattern_tail);
+        size_t repeated = 0;
+        while (repeated + 1 < parts.size() && !IsKeyword(parts[repeated + 1], "...")) {
+            ++repeated;
+        }
+        if (repeated + 1 >= parts.size()) {
+            for (auto part : parts) {
+                if (!Is<Cell>(form) || !Match(part, As<Cell>(form)->GetFirst(), binds)) {
+                    return false;
+                }
+                form = As<Cell>(form)->GetSecond();
+            }
+            return pattern_tail == nullptr ? form == nullptr : Match(pattern_tail, form, binds);
+        }
+
+        // parts[repeated] matches as many elements as the parts after the ellipsis leave.
+        Object* form_tail;
+        auto items = SplitList(form, form_tail);
+        size_t after = parts.size() - repeated - 2;
+        if (items.size() < repeated + after || (pattern_tail == nullptr && form_tail != nullptr)) {
+            return false;
+        }
+        size_t count = items.size() - repeated - after;
+        for (size_t i = 0; i < repeated; ++i) {
+            if (!Match(parts[i], items[i], binds)) {
+                return false;
+            }
+        }
+        std::unordered_set<std::string> vars;
+        CollectPatternVariables(parts[repeated], macro_->GetLiterals(), vars);
+        for (auto& var : vars) {
+            binds[var] = MacroMatch{nullptr, true, {}};
+        }
+        for (size_t i = 0; i < count; ++i) {
+            MacroBindings item;
+            if (!Match(parts[repeated], items[repeated + i], item)) {
+                return false;
+            }
+            for (auto& var : vars) {
+                binds[var].items.push_back(std::move(item[var]));
+            }
+        }
+        for (size_t i = 0; i < after; ++i) {
+            if (!Match(parts[repeated + 2 + i], items[repeated + count + i], binds)) {
+                return false;
+            }
+        }
+        return pattern_tail == nullptr || Match(pattern_tail, form_tail, binds);
+    }
+
+    Object* Instantiate(Object* tmpl, const MacroBindings& binds, bool quoted = false) {
+        if (Is<Symbol>(tmpl)) {
+            auto it = binds.find(As<Symbol>(tmpl)->GetName());
+            if (it == binds.end()) {
+                return quoted ? tmpl : Rename(As<Symbol>(tmpl));
+            }
+            if (it->second.repeated) {
+                throw SyntaxError("Pattern variable " + it->first + " is used without an ellipsis");
+            }
+            return it->second.form;
+        }
+        if (!Is<Cell>(tmpl)) {
+            return tmpl;
+        }
+
+        Object* tail;
+        auto parts = SplitList(tmpl, tail);
+        std::vector<Object*> res;
+        for (size_t i = 0; i < parts.size(); ++i) {
+            if (i + 1 < parts.size() && IsKeyword(parts[i + 1], "...")) {
+                for (auto& item : Repetitions(parts[i], binds)) {
+                    res.push_back(Instantiate(parts[i], item, quoted));
+                }
+                ++i;
+            } else {
+                res.push_back(Instantiate(parts[i], binds, quoted));
+            }
+            quoted = quoted || (i == 0 && IsQuote(parts[0], binds));
+        }
+        Object* list = tail == nullptr ? nullptr : Instantiate(tail, binds, quoted);
+        for (auto it = res.rbegin(); it != res.rend(); ++it) {
+            list = Heap::Instance()->Make<Cell>(*it, list);
+        }
+        return list;
+    }
+
+private:
+    // Bindings for every repetition of a template followed by an ellipsis.
+    std::vector<MacroBindings> Repetitions(Object* tmpl, const MacroBindings& binds) const {
+        std::unordered_set<std::string> names;
+        CollectPatternVariables(tmpl, {}, names);
+        std::vector<std::string> vars;
+        for (auto& name : names) {
+            auto it = binds.find(name);
+            if (it != binds.end() && it->second.repeated) {
+                vars.push_back(name);
+            }
+        }
+        if (vars.empty()) {
+            throw SyntaxError("Ellipsis follows a template without repeated pattern variables");
+        }
+        size_t count = binds.at(vars.front()).items.size();
+        for (auto& var : vars) {
+            if (binds.at(var).items.size() != count) {
+                throw SyntaxError("Pattern variables repeat different numbers of times");
+            }
+        }
+        std::vector<MacroBindings> res(count, binds);
+        for (size_t i = 0; i < count; ++i) {
+            for (auto& var : vars) {
+                res[i][var] = binds.at(var).items[i];
+            }
+        }
+        return res;
+    }
+
+    // Whether the head of a template form is quote where the macro is defined.
+    bool IsQuote(Object* head, const MacroBindings& binds) const {
+        if (!Is<Symbol>(head) || binds.contains(As<Symbol>(head)->GetName())) {
+            return false;
+        }
+        auto slot = macro_->GetScope()->Find(As<Symbol>(head));
+        return slot != nullptr && Is<Quote>(*slot);
+    }
+
+    Object* Rename(Symbol* symbol) {
+        if (IsKeyword(symbol, "...") || IsKeyword(symbol, "_")) {
+            return symbol;
+        }
+        auto& fresh = renames_[symbol->GetName()];
+        if (fresh == nullptr) {
+            fresh = Heap::Instance()->Make<Symbol>(
+                symbol->Unaliased()->GetName() + "#" + std::to_string(next_rename_++), symbol,
+                macro_->GetScope());
+        }
+        return fresh;
+    }
+
+    static inline std::atomic<uint64_t> next_rename_ = 0;
+
+    Macro* macro_;
+    std::unordered_map<std::string, Object*> renames_;
+};
+
+Object* ExpandRules(Macro* macro, Object* form) {
+    auto& rules = macro->GetRules();
+    for (size_t i = 0; i + 1 < rules.size(); i += 2) {
+        MacroExpander expander(macro);
+        MacroBindings binds;
+        // The keyword position of a pattern is ignored.
+        if (expander.Match(As<Cell>(rules[i])->GetSecond(), As<Cell>(form)->GetSecond(), binds)) {
+            return expander.Instantiate(rules[i + 1], binds);
+        }
+    }
+    throw SyntaxError("No syntax rule matches the use of " +
+                      (macro->GetName().empty() ? std::string("a macro") : macro->GetName()));
+}
+
+}  // namespace
+
+// Expansions are profiled as [expand name], apart from the evaluation of what they expand to.
+Object* Macro::Expand(Object* form, NameSpace* scope) {
+    scope->GetBudget().Step();
+    Object* expansion;
+    if (Profiler::IsEnabled() && !Heap::InTask()) {
+        ProfilerScope profiler_scope(name_.empty() ? "[expand]" : "[expand " + name_ + "]");
+        expansion = ExpandRules(this, form);
+    } else {
+        expansion = ExpandRules(this, form);
+    }
+    MarkAssigned(expansion, scope, false);
+    return expansion;
+}
+
+Object* Macro::ExpandInPlace(Cell* form, NameSpace* scope) {
+    auto expansion = Expand(form, scope);
+    if (!form->IsConstant() && !Heap::InTask() && !Scheduler::HasAsyncWork()) {
+        form->SetFirst(Heap::Instance()->Make<Begin>());
+        form->SetSecond(Heap::Instance()->Make<Cell>(expansion, nullptr));
+    }
+    return expansion;
+}
+
+Object* DefineSyntax::operator()(Object* obj, NameSpace* scope) {
+    ArgBuffer buffer(obj);
+    auto args = buffer.Span();
+    RequiresOnlyXArgumentsS(args, 2);
+    RequireType<Symbol>(args.front());
+    auto value = Calc(args.back(), scope);
+    if (!Is<Macro>(value)) {
+        throw SyntaxError("define-syntax expects syntax-rules");
+    }
+    if (As<Macro>(value)->GetName().empty()) {
+        As<Macro>(value)->SetName(Get<Symbol>(args.front()));
+    }
+    DefineHelper(args.front(), value, scope);
+    return args.front();
+}
+
+// (syntax-rules (literal ...) ((keyword . pattern) template) ...). Patterns support ellipses,
+// also followed by more elements or a dotted tail, _ and literals.
+Object* SyntaxRules::operator()(Object* obj, NameSpace* scope) {
+    ArgBuffer buffer(obj);
+    auto args = buffer.Span();
+    RequiresMinimumXArgumentsS(args, 1);
+    if (!IsListHelper(args.front())) {
+        throw SyntaxError("Invalid syntax-rules literals");
+    }
+    auto literals = ToVector(args.front());
+    for (auto literal : literals) {
+        if (!Is<Symbol>(literal)) {
+            throw SyntaxError("Symbols expected");
+        }
+    }
+    std::vector<Object*> rules;
+    for (auto rule : args.subspan(1)) {
+        if (!IsListHelper(rule) || rule == nullptr) {
+            throw SyntaxError("Invalid syntax rule");
+        }
+        auto parts = ToVector(rule);
+        if (parts.size() != 2 || !Is<Cell>(parts[0])) {
+            throw SyntaxError("Invalid syntax rule");
+        }
+        rules.push_back(parts[0]);
+        rules.push_back(parts[1]);
+    }
+    return Heap::Instance()->Make<Macro>(literals, rules, scope);
+}
@@ -1,16 +1,49 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
+#include <exception>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
 #include <string>
+#include <thread>
 #include <type_traits>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 #include "error.h"
 
+class Budget;
+class ConstantPool;
 class Heap;
+class NativeCode;
+
+// Coarse object categories the heap keeps allocation statistics for.
+enum class ObjectKind : uint8_t {
+    NUMBER,
+    SYMBOL,
+    CELL,
+    NAMESPACE,
+    LAMBDA,
+    PRIMITIVE,
+    FOLDED_FORM,
+    BOX,
+    OTHER,
+    COUNT
+};
+
+const char* ObjectKindName(ObjectKind kind);
+
+template <typename T>
+constexpr ObjectKind KindOf();
 
 class Object {
 public:
@@ -32,51 +65,254 @@ public:
         return used_;
     }
 
+    // Allocated by a parallel task that has not been joined yet.
+    bool IsTaskLocal() const {
+        return task_local_;
+    }
+
+    // Created by Heap::MakeRegional and not promoted to the heap.
+    bool IsRegional() const {
+        return regional_;
+    }
+
+    // Quoted data from the constant pool, which can not be modified.
+    bool IsConstant() const {
+        return constant_;
+    }
+
+    ObjectKind GetKind() const {
+        return kind_;
+    }
+
 protected:
     bool used_ = false;
+
+private:
+    // Filled in by Heap::Make, they fit into the padding after used_.
+    ObjectKind kind_ = ObjectKind::OTHER;
+    bool task_local_ = false;
+    bool regional_ = false;
+    bool constant_ = false;
+    uint16_t size_ = 0;
+};
+
+// Counters since the heap was created. Sizes are shallow: sizeof of the object itself,
+// without strings, vectors and maps it owns.
+struct HeapStats {
+    static constexpr size_t kPauseBuckets = 24;
+
+    uint64_t allocations = 0;
+    uint64_t bytes_allocated = 0;
+    std::array<uint64_t, static_cast<size_t>(ObjectKind::COUNT)> allocations_by_kind = {};
+
+    uint64_t collections = 0;
+    uint64_t objects_freed = 0;
+    uint64_t bytes_freed = 0;
+    // Objects that survived the last collection.
+    uint64_t survivors = 0;
+
+    // Objects freed by a collection are only subtracted once the main thread learns that it
+    // finished, at the end of a later Run.
+    uint64_t live_objects = 0;
+    uint64_t live_bytes = 0;
+    uint64_t peak_objects = 0;
+    uint64_t peak_bytes = 0;
+
+    // Time the collector thread spent marking and sweeping.
+    uint64_t total_background_ns = 0;
+
+    // Pauses are the time the main thread spends starting a collection or waiting for one.
+    // Bucket 0 counts pauses under 1us, bucket i > 0 pauses in [2^(i-1), 2^i) us; the last
+    // bucket also takes everything longer.
+    std::array<uint64_t, kPauseBuckets> pause_histogram = {};
+    uint64_t total_pause_ns = 0;
+    uint64_t max_pause_ns = 0;
 };
 
+// Objects allocated by a parallel task. Threads running tasks allocate into their own buffer
+// instead of the shared heap, which takes the objects over when the tasks are joined.
+struct AllocationBuffer {
+    std::vector<Object*> objects;
+};
+
+// Deletes regional objects, leaving promoted ones to the heap.
+struct RegionalDeleter {
+    void operator()(Object* obj) const {
+        if (obj->IsRegional()) {
+            delete obj;
+        }
+    }
+};
+
+template <typename T>
+using Regional = std::unique_ptr<T, RegionalDeleter>;
+
+// Mark and sweep on a collector thread, concurrently with the evaluation that follows. A
+// collection starts between evaluations, when the root is the only thing keeping objects alive
+// and no task is running, so the main thread only hands the objects allocated so far over to
+// the collector. The collector then marks what was reachable at that moment (snapshot at the
+// beginning): objects allocated meanwhile are created marked and are not traced, and every
+// store of a pointer into an existing object passes the pointer it overwrites to WriteBarrier,
+// which keeps it for the collector until marking ends.
 class Heap {
 public:
+    ~Heap();
+
     template <typename T, typename... Args>
         requires std::is_base_of_v<Object, T>
     T* Make(Args&&... args) {
-        int index = data_.size();
-        data_.emplace_back(nullptr);
-        data_[index] = std::move(std::unique_ptr<T>(new T(std::forward<Args>(args)...)));
-        return As<T>(data_[index].get());
+        static_assert(sizeof(T) <= UINT16_MAX);
+        auto obj = new T(std::forward<Args>(args)...);
+        obj->kind_ = KindOf<T>();
+        obj->size_ = sizeof(T);
+        obj->task_local_ = local_buffer_ != nullptr;
+        obj->used_ = IsMarking();
+        Register(obj);
+        return obj;
+    }
+
+    // Creates an object outside of the heap for an allocation that is not expected to outlive
+    // the caller. It is freed with the returned pointer unless Promote hands it over to the
+    // heap first.
+    template <typename T, typename... Args>
+        requires std::is_base_of_v<Object, T>
+    Regional<T> MakeRegional(Args&&... args) {
+        Regional<T> obj(new T(std::forward<Args>(args)...));
+        obj->kind_ = KindOf<T>();
+        obj->size_ = sizeof(T);
+        obj->task_local_ = local_buffer_ != nullptr;
+        obj->regional_ = true;
+        return obj;
+    }
+
+    void Promote(Object* obj) {
+        obj->regional_ = false;
+        obj->used_ = IsMarking();
+        Register(obj);
+    }
+
+    // Creates an object for the constant pool. It stays marked, so the collector does not
+    // look into it.
+    template <typename T, typename... Args>
+        requires std::is_base_of_v<Object, T>
+    std::unique_ptr<T> MakeConstant(Args&&... args) {
+        auto obj = std::make_unique<T>(std::forward<Args>(args)...);
+        obj->kind_ = KindOf<T>();
+        obj->size_ = sizeof(T);
+        obj->constant_ = true;
+        obj->used_ = true;
+        return obj;
     }
 
+    // Sends allocations of the calling thread to buffer, or back to the heap for nullptr.
+    static void SetLocalBuffer(AllocationBuffer* buffer) {
+        local_buffer_ = buffer;
+    }
+
+    static AllocationBuffer* GetLocalBuffer() {
+        return local_buffer_;
+    }
+
+    // Whether the calling thread is running a parallel task.
+    static bool InTask() {
+        return local_buffer_ != nullptr;
+    }
+
+    // Takes over the objects of a buffer whose tasks have all finished.
+    void Adopt(AllocationBuffer* buffer);
+
     static Heap* Instance() {
         static Heap instance;
         return &instance;
     }
 
-    void Clear() {
-        data_.clear();
+    // Waits for the collector, then frees every object.
+    void Clear();
+
+    const HeapStats& GetStats() const {
+        return stats_;
     }
 
-    size_t Size() {
-        return data_.size();
+    // Starts collecting everything unreachable from root. Called by the main thread between
+    // evaluations; while a collection is still running it returns at once and what became
+    // garbage since is left to the next one.
+    void Collect(Object* root);
+
+    // Waits until the running collection, if any, has finished and accounts for it.
+    void WaitForCollection();
+
+    static bool IsMarking() {
+        return marking_.load(std::memory_order_acquire);
     }
 
-    void RemoveTrash(Object* start) {
-        for (auto& e : data_) {
-            e->UnMark();
+    // Takes the pointer a store is about to overwrite.
+    static void WriteBarrier(Object* old) {
+        if (old != nullptr && IsMarking()) [[unlikely]] {
+            Instance()->Remember(old);
         }
+    }
+
+private:
+    struct CollectionResult {
+        uint64_t freed = 0;
+        uint64_t freed_bytes = 0;
+        uint64_t survivors = 0;
+        uint64_t duration_ns = 0;
+    };
 
-        start->Mark();
+    void Remember(Object* obj);
 
-        for (size_t i = 0; i < data_.size(); ++i) {
-            while (i < data_.size() && (data_[i] == nullptr || !data_[i]->GetMark())) {
-                std::swap(data_[i], data_.back());
-                data_.pop_back();
-            }
+    void CollectorLoop();
+
+    CollectionResult MarkAndSweep(Object* root);
+
+    // Accounts for a finished collection. Requires collector_mutex_.
+    void Publish();
+
+    void RecordPause(std::chrono::steady_clock::time_point begin);
+
+    void Register(Object* obj) {
+        if (local_buffer_ != nullptr) {
+            local_buffer_->objects.push_back(obj);
+            return;
         }
+        data_.emplace_back(obj);
+        Account(obj);
     }
 
-private:
+    void Account(Object* obj) {
+        ++stats_.allocations;
+        ++stats_.allocations_by_kind[static_cast<size_t>(obj->kind_)];
+        stats_.bytes_allocated += obj->size_;
+        stats_.live_bytes += obj->size_;
+        ++stats_.live_objects;
+        stats_.peak_objects = std::max(stats_.peak_objects, stats_.live_objects);
+        stats_.peak_bytes = std::max(stats_.peak_bytes, stats_.live_bytes);
+    }
+
+    static inline thread_local AllocationBuffer* local_buffer_ = nullptr;
+    static inline std::atomic<bool> marking_ = false;
+
+    // Objects allocated since the last collection started. Only the main thread changes it.
     std::vector<std::unique_ptr<Object>> data_;
+    HeapStats stats_;
+
+    // Survivors of earlier collections and the objects handed over to the running one. They
+    // belong to the collector thread while a collection runs.
+    std::vector<std::unique_ptr<Object>> old_;
+    std::vector<std::unique_ptr<Object>> snapshot_;
+
+    // Pointers overwritten while marking.
+    std::mutex remembered_mutex_;
+    std::vector<Object*> remembered_;
+
+    std::thread collector_;
+    std::mutex collector_mutex_;
+    std::condition_variable wake_, done_;
+    Object* root_ = nullptr;
+    bool collecting_ = false;
+    bool stop_ = false;
+    std::optional<CollectionResult> result_;
 };
 
 class Number : public Object {
@@ -100,13 +336,14 @@ private:
     int64_t value_;
 };
 
+// #t and #f are two permanent objects outside of the heap, so the collector never sees them
+// and predicates return them without allocating.
+
 class Boolean : public Object {
 public:
-    Boolean(bool val) : value_(val) {
-    }
-
-    bool& GetValue() {
-        return value_;
+    static Boolean* Instance(bool val) {
+        static Boolean true_object(true), false_object(false);
+        return val ? &true_object : &false_object;
     }
 
     bool GetValue() const {
@@ -114,16 +351,38 @@ public:
     }
 
     Object* Copy() override {
-        return Heap::Instance()->Make<Boolean>(value_);
+        return this;
     }
 
 private:
+    Boolean(bool val) : value_(val) {
+    }
+
     bool value_;
 };
 
+class NameSpace;
+
+// Per-name state shared by every Symbol with the same name.
+struct SymbolInfo {
+    // Set once the name is bound in any non-global namespace; from then on a global binding
+    // can be shadowed and cached global cells for this name are no longer used.
+    std::atomic<bool> bound_locally = false;
+    // Set once code that may rebind the name in the frame that binds it has been seen (see
+    // MarkAssigned); closures then never capture a local variable of this name.
+    std::atomic<bool> assigned = false;
+};
+
 class Symbol : public Object {
 public:
-    Symbol(const std::string& name) : name_(name) {
+    Symbol(const std::string& name) : name_(name), info_(Intern(name)) {
+    }
+
+    // A symbol put into an expansion by a macro template. Its name is unique, so it can not
+    // capture a variable of the use site, and unless the expansion binds it, it means what
+    // original means in the scope of the macro definition.
+    Symbol(const std::string& name, Symbol* original, NameSpace* scope)
+        : name_(name), info_(Intern(name)), original_(original), scope_(scope) {
     }
 
     const std::string& GetName() const {
@@ -134,12 +393,47 @@ public:
         return name_;
     }
 
+    SymbolInfo* GetInfo() const {
+        return info_;
+    }
+
+    Symbol*& GetOriginal() {
+        return original_;
+    }
+
+    NameSpace*& GetScope() {
+        return scope_;
+    }
+
+    // The symbol as written in the source, for quoted data and keywords such as else.
+    Symbol* Unaliased() {
+        auto symbol = this;
+        while (symbol->original_ != nullptr) {
+            symbol = symbol->original_;
+        }
+        return symbol;
+    }
+
     Object* Copy() override {
-        return Heap::Instance()->Make<Symbol>(name_);
+        return Heap::Instance()->Make<Symbol>(*this);
     }
 
+    void Mark() override;
+
+    static SymbolInfo* Intern(const std::string& name);
+
+    friend class NameSpace;
+
 private:
     std::string name_;
+    SymbolInfo* info_;
+    Symbol* original_ = nullptr;
+    NameSpace* scope_ = nullptr;
+
+    // Inline cache: the global binding cell this symbol resolved to and the global namespace
+    // it belongs to.
+    NameSpace* cached_global_ = nullptr;
+    Object** cached_cell_ = nullptr;
 };
 
 class Cell : public Object {
@@ -155,15 +449,29 @@ public:
         return second_;
     }
 
+    // Changes a pair that may already be reachable; the references above are for pairs that
+    // are still being built.
+    void SetFirst(Object* obj) {
+        Heap::WriteBarrier(first_);
+        std::atomic_ref(first_).store(obj, std::memory_order_release);
+    }
+
+    void SetSecond(Object* obj) {
+        Heap::WriteBarrier(second_);
+        std::atomic_ref(second_).store(obj, std::memory_order_release);
+    }
+
     Object* Copy() override;
 
     void Mark() override {
         used_ = true;
-        if (first_ != nullptr && !first_->GetMark()) {
-            first_->Mark();
+        auto first = std::atomic_ref(first_).load(std::memory_order_acquire);
+        auto second = std::atomic_ref(second_).load(std::memory_order_acquire);
+        if (first != nullptr && !first->GetMark()) {
+            first->Mark();
         }
-        if (second_ != nullptr && !second_->GetMark()) {
-            second_->Mark();
+        if (second != nullptr && !second->GetMark()) {
+            second->Mark();
         }
     }
 
@@ -207,16 +515,103 @@ void RequireType(Object* obj) {
 
 ///////////////////////////////////////////////////////////////////////////////
 
+// Shared binding of a local variable that closures captured (see NameSpace::Share). Lookups
+// see through it, so a set! in the frame or in any of the closures is seen by all of them.
+
+class Box : public Object {
+public:
+    explicit Box(Object* value) : value_(value) {
+    }
+
+    Object*& GetValue() {
+        return value_;
+    }
+
+    Object* Copy() override {
+        return this;
+    }
+
+    void Mark() override;
+
+private:
+    Object* value_;
+};
+
 class NameSpace : public Object {
 public:
-    NameSpace(NameSpace* upper = nullptr) : upper_(upper) {
+    NameSpace(NameSpace* upper = nullptr)
+        : upper_(upper), global_(upper == nullptr ? this : upper->global_) {
+    }
+
+    // Call frames and the frames of binding forms are regional (see Lambda::Apply) until
+    // something keeps a pointer to them: a closure, a promise or a future. Those call Escape,
+    // which moves the frame to the heap together with the regional frames above it, so the
+    // upper namespace of a namespace on the heap is never regional.
+    void Escape() {
+        for (auto ns = this; ns != nullptr && ns->IsRegional(); ns = ns->upper_) {
+            Heap::Instance()->Promote(ns);
+        }
     }
 
     Object*& Get(const std::string& name);
 
+    Object*& Get(Symbol* symbol);
+
+    Object** Find(const std::string& name);
+
+    Object** Find(Symbol* symbol);
+
+    // The namespace in the chain that binds name, nullptr if there is none.
+    NameSpace* FindOwner(const std::string& name);
+
+    // The namespace that binds symbol and the symbol it binds: the original one for a symbol
+    // of a macro expansion that is only bound where the macro was defined. Both are nullptr if
+    // the symbol is not bound.
+    std::pair<NameSpace*, Symbol*> Resolve(Symbol* symbol);
+
+    // Moves the value bound to symbol in this namespace into a box, for closures to bind
+    // instead of a copy of the value. Returns nullptr if a parallel task would have to change
+    // a namespace it shares with others.
+    Box* Share(Symbol* symbol);
+
     void Set(const std::string& name, Object* obj);
 
+    void Set(Symbol* symbol, Object* obj);
+
+    NameSpace* GetUpper() const {
+        return upper_;
+    }
+
+    NameSpace* GetGlobal() const {
+        return global_;
+    }
+
+    // The budget of the interpreter the namespace belongs to, set on its global namespace.
+    Budget& GetBudget() const {
+        return *global_->budget_;
+    }
+
+    void SetBudget(Budget* budget) {
+        budget_ = budget;
+    }
+
+    // The constant pool of the interpreter, set on its global namespace like the budget.
+    ConstantPool& GetConstants() const {
+        return *global_->constants_;
+    }
+
+    void SetConstants(ConstantPool* constants) {
+        constants_ = constants;
+    }
+
+    const std::unordered_map<std::string, Object*>& GetBindings() const {
+        return data_;
+    }
+
     Object* Copy() override {
+        if (upper_ != nullptr) {
+            upper_->Escape();
+        }
         auto res = Heap::Instance()->Make<NameSpace>(upper_);
         for (auto [key, value_] : data_) {
             res->Set(key, value_->Copy());
@@ -224,12 +619,66 @@ public:
         return res;
     }
 
+    void Mark() override;
+
+private:
+    std::unordered_map<std::string, Object*> data_;
+    NameSpace* upper_;
+    NameSpace* global_;
+    Budget* budget_ = nullptr;
+    ConstantPool* constants_ = nullptr;
+};
+
+// Result of constant folding. Evaluates to folded_ while every binding it was derived from
+// still holds the same object, otherwise falls back to the original form.
+
+class FoldedForm : public Object {
+public:
+    FoldedForm(Object* folded, Object* original) : folded_(folded), original_(original) {
+    }
+
+    Object*& GetFolded() {
+        return folded_;
+    }
+
+    Object*& GetOriginal() {
+        return original_;
+    }
+
+    std::vector<std::pair<Object**, Object*>>& GetDependencies() {
+        return deps_;
+    }
+
+    void AddDependency(Object** cell) {
+        deps_.emplace_back(cell, *cell);
+    }
+
+    void AddDependencies(const std::vector<std::pair<Object**, Object*>>& deps) {
+        deps_.insert(deps_.end(), deps.begin(), deps.end());
+    }
+
+    bool IsValid() const {
+        for (auto [cell, value] : deps_) {
+            if (*cell != value) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    Object* Copy() override {
+        return this;
+    }
+
     void Mark() override {
         used_ = true;
-        if (upper_ != nullptr) {
-            upper_->Mark();
+        if (folded_ != nullptr && !folded_->GetMark()) {
+            folded_->Mark();
+        }
+        if (original_ != nullptr && !original_->GetMark()) {
+            original_->Mark();
         }
-        for (auto [key, value] : data_) {
+        for (auto [cell, value] : deps_) {
             if (value != nullptr && !value->GetMark()) {
                 value->Mark();
             }
@@ -237,8 +686,8 @@ public:
     }
 
 private:
-    std::unordered_map<std::string, Object*> data_;
-    NameSpace* upper_;
+    Object *folded_, *original_;
+    std::vector<std::pair<Object**, Object*>> deps_;
 };
 
 // Functors
@@ -250,6 +699,64 @@ public:
     virtual std::string GetFunctorName() const = 0;
 };
 
+// Evaluated call arguments. Short argument lists live in the inline buffer, so passing them
+// does not touch the allocator; longer ones spill into a vector.
+
+class ArgBuffer {
+public:
+    static constexpr size_t kInlineSize = 8;
+
+    ArgBuffer() = default;
+
+    // Collects the elements of a proper list.
+    explicit ArgBuffer(Object* list);
+
+    ArgBuffer(const ArgBuffer&) = delete;
+    ArgBuffer& operator=(const ArgBuffer&) = delete;
+
+    void PushBack(Object* obj) {
+        if (size_ < kInlineSize) {
+            inline_[size_++] = obj;
+            return;
+        }
+        if (size_ == kInlineSize) {
+            overflow_.assign(inline_.begin(), inline_.end());
+        }
+        overflow_.push_back(obj);
+        ++size_;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    std::span<Object*> Span() {
+        if (size_ <= kInlineSize) {
+            return {inline_.data(), size_};
+        }
+        return overflow_;
+    }
+
+private:
+    std::array<Object*, kInlineSize> inline_;
+    std::vector<Object*> overflow_;
+    size_t size_ = 0;
+};
+
+// A functor whose arguments are all evaluated before the call. Apply gets a span over the
+// evaluated values, which is only valid for the duration of the call.
+
+class Procedure : public Functor {
+public:
+    Object* operator()(Object* obj, NameSpace* scope) final;
+
+    // Calls the procedure with evaluated arguments the way the evaluator does, profiler frame
+    // included. Procedures that take callbacks call them through it rather than Apply.
+    Object* Call(std::span<Object*> args);
+
+    virtual Object* Apply(std::span<Object*> args) = 0;
+};
+
 class Quote : public Functor {
 public:
     Object* operator()(Object* obj, NameSpace* scope) override;
@@ -263,9 +770,9 @@ public:
     }
 };
 
-class IsPair : public Functor {
+class IsPair : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
         return "[pair?]";
@@ -276,9 +783,9 @@ public:
     }
 };
 
-class IsNull : public Functor {
+class IsNull : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
         return "[null?]";
@@ -289,9 +796,9 @@ public:
     }
 };
 
-class IsList : public Functor {
+class IsList : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
         return "[list?]";
@@ -302,9 +809,9 @@ public:
     }
 };
 
-class List : public Functor {
+class List : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
         return "[list]";
@@ -315,9 +822,9 @@ public:
     }
 };
 
-class Cons : public Functor {
+class Cons : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
         return "[cons]";
@@ -328,9 +835,9 @@ public:
     }
 };
 
-class Car : public Functor {
+class Car : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
         return "[car]";
@@ -341,9 +848,9 @@ public:
     }
 };
 
-class Cdr : public Functor {
+class Cdr : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
         return "[cdr]";
@@ -354,9 +861,9 @@ public:
     }
 };
 
-class ListRef : public Functor {
+class ListRef : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
         return "[list-ref]";
@@ -367,9 +874,9 @@ public:
     }
 };
 
-class ListTail : public Functor {
+class ListTail : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
         return "[list-tail]";
@@ -380,230 +887,376 @@ public:
     }
 };
 
-class IsNumber : public Functor {
+// Native list library. Lists are walked with cycle detection; only the procedures passed in
+// are evaluated.
+
+class Length : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
-        return "[number?]";
+        return "[length]";
     }
 
     Object* Copy() override {
-        return Heap::Instance()->Make<IsNumber>();
+        return Heap::Instance()->Make<Length>();
     }
 };
 
-class EqualTo : public Functor {
+class Append : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
-        return "[=]";
+        return "[append]";
     }
 
     Object* Copy() override {
-        return Heap::Instance()->Make<EqualTo>();
+        return Heap::Instance()->Make<Append>();
     }
 };
 
-class Greater : public Functor {
+class Reverse : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
-        return "[>]";
+        return "[reverse]";
     }
 
     Object* Copy() override {
-        return Heap::Instance()->Make<Greater>();
+        return Heap::Instance()->Make<Reverse>();
     }
 };
 
-class Less : public Functor {
+class Map : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
-        return "[<]";
+        return "[map]";
     }
 
     Object* Copy() override {
-        return Heap::Instance()->Make<Less>();
+        return Heap::Instance()->Make<Map>();
     }
 };
 
-class GreaterEqual : public Functor {
+class Filter : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
-        return "[>=]";
+        return "[filter]";
     }
 
     Object* Copy() override {
-        return Heap::Instance()->Make<GreaterEqual>();
+        return Heap::Instance()->Make<Filter>();
     }
 };
 
-class LessEqual : public Functor {
+class FoldLeft : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
-        return "[<=]";
+        return "[fold-left]";
     }
 
     Object* Copy() override {
-        return Heap::Instance()->Make<LessEqual>();
+        return Heap::Instance()->Make<FoldLeft>();
     }
 };
 
-class Plus : public Functor {
+class FoldRight : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
-        return "[+]";
+        return "[fold-right]";
     }
 
     Object* Copy() override {
-        return Heap::Instance()->Make<Plus>();
+        return Heap::Instance()->Make<FoldRight>();
     }
 };
 
-class Minus : public Functor {
+class Assq : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
-        return "[-]";
+        return "[assq]";
     }
 
     Object* Copy() override {
-        return Heap::Instance()->Make<Minus>();
+        return Heap::Instance()->Make<Assq>();
     }
 };
 
-class Multiplies : public Functor {
+class Assoc : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
-        return "[*]";
+        return "[assoc]";
     }
 
     Object* Copy() override {
-        return Heap::Instance()->Make<Multiplies>();
+        return Heap::Instance()->Make<Assoc>();
     }
 };
 
-class Divides : public Functor {
+class Member : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
-        return "[/]";
+        return "[member]";
     }
 
     Object* Copy() override {
-        return Heap::Instance()->Make<Divides>();
+        return Heap::Instance()->Make<Member>();
     }
 };
 
-class Max : public Functor {
+class Sort : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
-        return "[max]";
+        return "[sort]";
     }
 
     Object* Copy() override {
-        return Heap::Instance()->Make<Max>();
+        return Heap::Instance()->Make<Sort>();
     }
 };
 
-class Min : public Functor {
+class IsNumber : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
-        return "[min]";
+        return "[number?]";
     }
 
     Object* Copy() override {
-        return Heap::Instance()->Make<Min>();
+        return Heap::Instance()->Make<IsNumber>();
     }
 };
 
-class Abs : public Functor {
+class EqualTo : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
-        return "[abs]";
+        return "[=]";
     }
 
     Object* Copy() override {
-        return Heap::Instance()->Make<Abs>();
+        return Heap::Instance()->Make<EqualTo>();
     }
 };
 
-class IsBoolean : public Functor {
+class Greater : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
-        return "[boolean?]";
+        return "[>]";
     }
 
     Object* Copy() override {
-        return Heap::Instance()->Make<IsBoolean>();
+        return Heap::Instance()->Make<Greater>();
     }
 };
 
-class Not : public Functor {
+class Less : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
-        return "[not]";
+        return "[<]";
     }
 
     Object* Copy() override {
-        return Heap::Instance()->Make<Not>();
+        return Heap::Instance()->Make<Less>();
     }
 };
 
-class And : public Functor {
+class GreaterEqual : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
-        return "[and]";
+        return "[>=]";
     }
 
     Object* Copy() override {
-        return Heap::Instance()->Make<And>();
+        return Heap::Instance()->Make<GreaterEqual>();
     }
 };
 
-class Or : public Functor {
+class LessEqual : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
-        return "[or]";
+        return "[<=]";
     }
 
     Object* Copy() override {
-        return Heap::Instance()->Make<Or>();
+        return Heap::Instance()->Make<LessEqual>();
     }
 };
 
-// Advanced
-
-class Define : public Functor {
+class Plus : public Procedure {
+public:
+    Object* Apply(std::span<Object*> args) override;
+
+    std::string GetFunctorName() const override {
+        return "[+]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<Plus>();
+    }
+};
+
+class Minus : public Procedure {
+public:
+    Object* Apply(std::span<Object*> args) override;
+
+    std::string GetFunctorName() const override {
+        return "[-]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<Minus>();
+    }
+};
+
+class Multiplies : public Procedure {
+public:
+    Object* Apply(std::span<Object*> args) override;
+
+    std::string GetFunctorName() const override {
+        return "[*]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<Multiplies>();
+    }
+};
+
+class Divides : public Procedure {
+public:
+    Object* Apply(std::span<Object*> args) override;
+
+    std::string GetFunctorName() const override {
+        return "[/]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<Divides>();
+    }
+};
+
+class Max : public Procedure {
+public:
+    Object* Apply(std::span<Object*> args) override;
+
+    std::string GetFunctorName() const override {
+        return "[max]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<Max>();
+    }
+};
+
+class Min : public Procedure {
+public:
+    Object* Apply(std::span<Object*> args) override;
+
+    std::string GetFunctorName() const override {
+        return "[min]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<Min>();
+    }
+};
+
+class Abs : public Procedure {
+public:
+    Object* Apply(std::span<Object*> args) override;
+
+    std::string GetFunctorName() const override {
+        return "[abs]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<Abs>();
+    }
+};
+
+class IsBoolean : public Procedure {
+public:
+    Object* Apply(std::span<Object*> args) override;
+
+    std::string GetFunctorName() const override {
+        return "[boolean?]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<IsBoolean>();
+    }
+};
+
+class Not : public Procedure {
+public:
+    Object* Apply(std::span<Object*> args) override;
+
+    std::string GetFunctorName() const override {
+        return "[not]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<Not>();
+    }
+};
+
+class And : public Functor {
+public:
+    Object* operator()(Object* obj, NameSpace* scope) override;
+
+    std::string GetFunctorName() const override {
+        return "[and]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<And>();
+    }
+};
+
+class Or : public Functor {
+public:
+    Object* operator()(Object* obj, NameSpace* scope) override;
+
+    std::string GetFunctorName() const override {
+        return "[or]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<Or>();
+    }
+};
+
+// Advanced
+
+class Define : public Functor {
 public:
     Object* operator()(Object* obj, NameSpace* scope) override;
 
@@ -616,9 +1269,9 @@ public:
     }
 };
 
-class IsSymbol : public Functor {
+class IsSymbol : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
         return "[symbol?]";
@@ -642,9 +1295,9 @@ public:
     }
 };
 
-class SetCar : public Functor {
+class SetCar : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
         return "[set-car!]";
@@ -655,9 +1308,9 @@ public:
     }
 };
 
-class SetCdr : public Functor {
+class SetCdr : public Procedure {
 public:
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
         return "[set-cdr!]";
@@ -668,6 +1321,321 @@ public:
     }
 };
 
+// Wraps a procedure with a result cache keyed by its arguments. Only calls whose arguments
+// are all numbers, booleans, symbols or the empty list are cached; the least recently used
+// result is evicted once capacity is exceeded. Cached results are marked by the collector,
+// evicted ones become garbage. Copies share the cache.
+
+class Memoized : public Procedure {
+public:
+    static constexpr size_t kDefaultCapacity = 1024;
+
+    Memoized(Procedure* func, size_t capacity) : func_(func), capacity_(capacity) {
+    }
+
+    Object* Apply(std::span<Object*> args) override;
+
+    std::string GetFunctorName() const override {
+        return "[memoized]";
+    }
+
+    Procedure*& GetFunction() {
+        return func_;
+    }
+
+    size_t GetCapacity() const {
+        return capacity_;
+    }
+
+    Object* Copy() override {
+        return this;
+    }
+
+    void Mark() override;
+
+private:
+    using Entries = std::list<std::pair<std::string, Object*>>;
+
+    Procedure* func_;
+    size_t capacity_;
+    // Parallel tasks may call the same memoized procedure.
+    std::mutex mutex_;
+    Entries order_;
+    std::unordered_map<std::string, Entries::iterator> index_;
+};
+
+class Memoize : public Procedure {
+public:
+    Object* Apply(std::span<Object*> args) override;
+
+    std::string GetFunctorName() const override {
+        return "[memoize]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<Memoize>();
+    }
+};
+
+class DefineMemoized : public Functor {
+public:
+    Object* operator()(Object* obj, NameSpace* scope) override;
+
+    std::string GetFunctorName() const override {
+        return "[define-memoized]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<DefineMemoized>();
+    }
+};
+
+// Data-parallel primitives. The list is cut into chunks that run as parallel tasks; results
+// are combined in list order, so they do not depend on scheduling. The procedure must not
+// modify data it did not allocate itself (RuntimeError).
+
+class ParMap : public Procedure {
+public:
+    Object* Apply(std::span<Object*> args) override;
+
+    std::string GetFunctorName() const override {
+        return "[par-map]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<ParMap>();
+    }
+};
+
+class ParForEach : public Procedure {
+public:
+    Object* Apply(std::span<Object*> args) override;
+
+    std::string GetFunctorName() const override {
+        return "[par-for-each]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<ParForEach>();
+    }
+};
+
+// (par-reduce f init list) folds every chunk from its first element and then folds the chunk
+// results from init, left to right. For an associative f this equals a sequential fold.
+class ParReduce : public Procedure {
+public:
+    Object* Apply(std::span<Object*> args) override;
+
+    std::string GetFunctorName() const override {
+        return "[par-reduce]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<ParReduce>();
+    }
+};
+
+// Value of (future expr): expr is evaluated by the scheduler while the caller goes on, and
+// touching the future waits for the value. The collector waits for pending futures first.
+
+class Future : public Object {
+public:
+    Future(Object* expr, NameSpace* scope) : expr_(expr), scope_(scope) {
+        scope_->Escape();
+    }
+
+    // Evaluates expr, keeping its value or the error it raised.
+    void Run();
+
+    // Returns the value once it is ready, running queued tasks meanwhile, or rethrows the
+    // error.
+    Object* Touch();
+
+    Object* Copy() override {
+        return this;
+    }
+
+    void Mark() override {
+        used_ = true;
+        for (Object* obj : {expr_, static_cast<Object*>(scope_), result_}) {
+            if (obj != nullptr && !obj->GetMark()) {
+                obj->Mark();
+            }
+        }
+    }
+
+private:
+    Object* expr_;
+    NameSpace* scope_;
+    Object* result_ = nullptr;
+    std::exception_ptr error_;
+    std::atomic<bool> done_ = false;
+};
+
+class CreateFuture : public Functor {
+public:
+    Object* operator()(Object* obj, NameSpace* scope) override;
+
+    std::string GetFunctorName() const override {
+        return "[future]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<CreateFuture>();
+    }
+};
+
+class Touch : public Procedure {
+public:
+    Object* Apply(std::span<Object*> args) override;
+
+    std::string GetFunctorName() const override {
+        return "[touch]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<Touch>();
+    }
+};
+
+// Value of (delay expr): expr is evaluated by the first force, later ones return the same
+// value. A forced promise drops expr and its scope, so it only keeps its value alive.
+
+class Promise : public Object {
+public:
+    Promise(Object* expr = nullptr, NameSpace* scope = nullptr) : expr_(expr), scope_(scope) {
+        if (scope_ != nullptr) {
+            scope_->Escape();
+        }
+    }
+
+    Object* Force();
+
+    bool IsForced() const {
+        return forced_;
+    }
+
+    // Makes the promise forced with value.
+    void Resolve(Object* value);
+
+    Object*& GetExpression() {
+        return expr_;
+    }
+
+    NameSpace*& GetScope() {
+        return scope_;
+    }
+
+    Object* GetValue() const {
+        return value_;
+    }
+
+    Object* Copy() override {
+        return this;
+    }
+
+    void Mark() override;
+
+private:
+    Object* expr_;
+    NameSpace* scope_;
+    Object* value_ = nullptr;
+    bool forced_ = false;
+    std::mutex mutex_;
+};
+
+class Delay : public Functor {
+public:
+    Object* operator()(Object* obj, NameSpace* scope) override;
+
+    std::string GetFunctorName() const override {
+        return "[delay]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<Delay>();
+    }
+};
+
+class Force : public Procedure {
+public:
+    Object* Apply(std::span<Object*> args) override;
+
+    std::string GetFunctorName() const override {
+        return "[force]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<Force>();
+    }
+};
+
+class MakePromise : public Procedure {
+public:
+    Object* Apply(std::span<Object*> args) override;
+
+    std::string GetFunctorName() const override {
+        return "[make-promise]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<MakePromise>();
+    }
+};
+
+// (cons-stream a b) is (cons a (delay b)).
+class ConsStream : public Functor {
+public:
+    Object* operator()(Object* obj, NameSpace* scope) override;
+
+    std::string GetFunctorName() const override {
+        return "[cons-stream]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<ConsStream>();
+    }
+};
+
+class StreamCar : public Procedure {
+public:
+    Object* Apply(std::span<Object*> args) override;
+
+    std::string GetFunctorName() const override {
+        return "[stream-car]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<StreamCar>();
+    }
+};
+
+class StreamCdr : public Procedure {
+public:
+    Object* Apply(std::span<Object*> args) override;
+
+    std::string GetFunctorName() const override {
+        return "[stream-cdr]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<StreamCdr>();
+    }
+};
+
+class GcStats : public Procedure {
+public:
+    Object* Apply(std::span<Object*> args) override;
+
+    std::string GetFunctorName() const override {
+        return "[gc-stats]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<GcStats>();
+    }
+};
+
 class If : public Functor {
 public:
     Object* operator()(Object* obj, NameSpace* scope) override;
@@ -681,33 +1649,241 @@ public:
     }
 };
 
-class Lambda : public Functor {
+class Lambda : public Procedure {
 public:
     Lambda() : arg_names_(), body_(), scope_(nullptr) {
     }
 
     Lambda(std::vector<Object*>& args, std::vector<Object*>& body, NameSpace* scope)
-        : arg_names_(args), body_(body), scope_(Heap::Instance()->Make<NameSpace>(scope)) {
+        : arg_names_(args), body_(body), scope_(scope) {
+        scope_->Escape();
     }
 
-    Object* operator()(Object* obj, NameSpace* scope) override;
+    Object* Apply(std::span<Object*> args) override;
 
     std::string GetFunctorName() const override {
         return "[create-lambda]";
     }
 
+    // Name the lambda was defined under, empty for anonymous lambdas.
+    const std::string& GetName() const {
+        return name_;
+    }
+
+    void SetName(const std::string& name) {
+        name_ = name;
+    }
+
+    std::vector<Object*>& GetArgNames() {
+        return arg_names_;
+    }
+
+    std::vector<Object*>& GetBody() {
+        return body_;
+    }
+
+    NameSpace*& GetScope() {
+        return scope_;
+    }
+
     Object* Copy() override;
 
+    void Mark() override;
+
+private:
+    std::vector<Object*> arg_names_, body_;
+    NameSpace* scope_;
+    std::string name_;
+    // Calls so far, until the lambda is hot enough to be compiled.
+    uint32_t calls_ = 0;
+    std::shared_ptr<NativeCode> native_;
+};
+
+class CreateLambda : public Functor {
+public:
+    Object* operator()(Object* obj, NameSpace* scope) override;
+
+    std::string GetFunctorName() const override {
+        return "[create-lambda]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<CreateLambda>();
+    }
+};
+
+class Begin : public Functor {
+public:
+    Object* operator()(Object* obj, NameSpace* scope) override;
+
+    std::string GetFunctorName() const override {
+        return "[begin]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<Begin>();
+    }
+};
+
+class Let : public Functor {
+public:
+    Object* operator()(Object* obj, NameSpace* scope) override;
+
+    std::string GetFunctorName() const override {
+        return "[let]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<Let>();
+    }
+};
+
+class LetStar : public Functor {
+public:
+    Object* operator()(Object* obj, NameSpace* scope) override;
+
+    std::string GetFunctorName() const override {
+        return "[let*]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<LetStar>();
+    }
+};
+
+class Letrec : public Functor {
+public:
+    Object* operator()(Object* obj, NameSpace* scope) override;
+
+    std::string GetFunctorName() const override {
+        return "[letrec]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<Letrec>();
+    }
+};
+
+class Cond : public Functor {
+public:
+    Object* operator()(Object* obj, NameSpace* scope) override;
+
+    std::string GetFunctorName() const override {
+        return "[cond]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<Cond>();
+    }
+};
+
+class Case : public Functor {
+public:
+    Object* operator()(Object* obj, NameSpace* scope) override;
+
+    std::string GetFunctorName() const override {
+        return "[case]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<Case>();
+    }
+};
+
+class When : public Functor {
+public:
+    Object* operator()(Object* obj, NameSpace* scope) override;
+
+    std::string GetFunctorName() const override {
+        return "[when]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<When>();
+    }
+};
+
+class Unless : public Functor {
+public:
+    Object* operator()(Object* obj, NameSpace* scope) override;
+
+    std::string GetFunctorName() const override {
+        return "[unless]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<Unless>();
+    }
+};
+
+class Do : public Functor {
+public:
+    Object* operator()(Object* obj, NameSpace* scope) override;
+
+    std::string GetFunctorName() const override {
+        return "[do]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<Do>();
+    }
+};
+
+// Macros
+
+// Value of (syntax-rules (literal ...) (pattern template) ...). rules_ holds patterns and
+// templates in turn. The symbols of a template are renamed in every expansion, so they never
+// capture the variables of the macro use, and mean what they mean in the scope of the macro
+// definition unless the expansion binds them.
+
+class Macro : public Object {
+public:
+    Macro() = default;
+
+    Macro(std::vector<Object*>& literals, std::vector<Object*>& rules, NameSpace* scope)
+        : literals_(literals), rules_(rules), scope_(scope) {
+        scope_->Escape();
+    }
+
+    // Expansion of a use of the macro in scope.
+    Object* Expand(Object* form, NameSpace* scope);
+
+    // Expands the form and, unless other threads may be reading it, rewrites it into
+    // ([begin] expansion), so that it is never expanded again.
+    Object* ExpandInPlace(Cell* form, NameSpace* scope);
+
+    const std::string& GetName() const {
+        return name_;
+    }
+
+    void SetName(const std::string& name) {
+        name_ = name;
+    }
+
+    std::vector<Object*>& GetLiterals() {
+        return literals_;
+    }
+
+    std::vector<Object*>& GetRules() {
+        return rules_;
+    }
+
+    // Where the macro was defined, which gives the symbols of its templates their meaning.
+    NameSpace*& GetScope() {
+        return scope_;
+    }
+
+    Object* Copy() override {
+        return this;
+    }
+
     void Mark() override {
         used_ = true;
-        for (auto& e : arg_names_) {
-            if (e != nullptr && !e->GetMark()) {
-                e->Mark();
-            }
-        }
-        for (auto& e : body_) {
-            if (e != nullptr && !e->GetMark()) {
-                e->Mark();
+        for (auto objs : {&literals_, &rules_}) {
+            for (auto obj : *objs) {
+                if (obj != nullptr && !obj->GetMark()) {
+                    obj->Mark();
+                }
             }
         }
         if (scope_ != nullptr && !scope_->GetMark()) {
@@ -716,19 +1892,56 @@ public:
     }
 
 private:
-    std::vector<Object*> arg_names_, body_;
-    NameSpace* scope_;
+    std::vector<Object*> literals_, rules_;
+    NameSpace* scope_ = nullptr;
+    std::string name_;
 };
 
-class CreateLambda : public Functor {
+class DefineSyntax : public Functor {
 public:
     Object* operator()(Object* obj, NameSpace* scope) override;
 
     std::string GetFunctorName() const override {
-        return "[create-lambda]";
+        return "[define-syntax]";
     }
 
     Object* Copy() override {
-        return Heap::Instance()->Make<CreateLambda>();
+        return Heap::Instance()->Make<DefineSyntax>();
     }
 };
+
+class SyntaxRules : public Functor {
+public:
+    Object* operator()(Object* obj, NameSpace* scope) override;
+
+    std::string GetFunctorName() const override {
+        return "[syntax-rules]";
+    }
+
+    Object* Copy() override {
+        return Heap::Instance()->Make<SyntaxRules>();
+    }
+};
+
+template <typename T>
+constexpr ObjectKind KindOf() {
+    if constexpr (std::is_base_of_v<Number, T>) {
+        return ObjectKind::NUMBER;
+    } else if constexpr (std::is_base_of_v<Symbol, T>) {
+        return ObjectKind::SYMBOL;
+    } else if constexpr (std::is_base_of_v<Cell, T>) {
+        return ObjectKind::CELL;
+    } else if constexpr (std::is_base_of_v<NameSpace, T>) {
+        return ObjectKind::NAMESPACE;
+    } else if constexpr (std::is_base_of_v<Lambda, T>) {
+        return ObjectKind::LAMBDA;
+    } else if constexpr (std::is_base_of_v<Functor, T>) {
+        return ObjectKind::PRIMITIVE;
+    } else if constexpr (std::is_base_of_v<FoldedForm, T>) {
+        return ObjectKind::FOLDED_FORM;
+    } else if constexpr (std::is_base_of_v<Box, T>) {
+        return ObjectKind::BOX;
+    } else {
+        return ObjectKind::OTHER;
+    }
+}
@@ -0,0 +1,295 @@
+#include "optimizer.h"
+
+#include <string>
+#include <unordered_set>
+#include "constant_pool.h"
+#include "error.h"
+#include "scheme.h"
+
+namespace {
+
+template <typename... Ts>
+bool IsAnyOf(Object* obj) {
+    return (Is<Ts>(obj) || ...);
+}
+
+bool IsFoldable(Object* func) {
+    return IsAnyOf<EqualTo, Greater, Less, GreaterEqual, LessEqual, Plus, Minus, Multiplies,
+                   Divides, Max, Min, Abs, Not, IsNumber, IsBoolean>(func);
+}
+
+// Special forms whose first argument names what they bind. A named let binds the names in its
+// second argument as well.
+bool IsBinder(Object* func) {
+    return IsAnyOf<Define, Set, CreateLambda, DefineMemoized, Let, LetStar, Letrec, Do,
+                   DefineSyntax>(func);
+}
+
+bool IsLiteral(Object* obj) {
+    return Is<Number>(obj) || Is<Boolean>(obj);
+}
+
+bool IsZero(Object* obj) {
+    return Is<Number>(obj) && As<Number>(obj)->GetValue() == 0;
+}
+
+class Optimizer {
+public:
+    explicit Optimizer(NameSpace* scope) : scope_(scope) {
+    }
+
+    Object* Run(Object* object) {
+        MarkAssigned(object, scope_);
+        CollectBound(object);
+        return Fold(object);
+    }
+
+private:
+    // Names that the form may bind itself (define, set! or lambda parameters) are never
+    // resolved to their current global value.
+    void CollectBound(Object* obj) {
+        while (Is<Cell>(obj)) {
+            auto cell = As<Cell>(obj);
+            if (Is<Symbol>(cell->GetFirst()) && Is<Cell>(cell->GetSecond())) {
+                auto func = scope_->Find(As<Symbol>(cell->GetFirst()));
+                auto target = As<Cell>(cell->GetSecond())->GetFirst();
+                if (func != nullptr && Is<Quote>(*func)) {
+                    return;
+                }
+                if (func != nullptr && IsAnyOf<Let, LetStar, Letrec, Do>(*func)) {
+                    auto rest = As<Cell>(cell->GetSecond())->GetSecond();
+                    if (Is<Let>(*func) && Is<Symbol>(target) && Is<Cell>(rest)) {
+                        CollectSymbols(target);
+                        target = As<Cell>(rest)->GetFirst();
+                    }
+                    CollectBindingNames(target);
+                } else if (func != nullptr && IsBinder(*func)) {
+                    CollectSymbols(target);
+                }
+            }
+            CollectBound(cell->GetFirst());
+            obj = cell->GetSecond();
+        }
+    }
+
+    // The names of the bindings of a let form or do; their inits are expressions.
+    void CollectBindingNames(Object* bindings) {
+        for (; Is<Cell>(bindings); bindings = As<Cell>(bindings)->GetSecond()) {
+            auto binding = As<Cell>(bindings)->GetFirst();
+            CollectSymbols(Is<Cell>(binding) ? As<Cell>(binding)->GetFirst() : binding);
+        }
+    }
+
+    void CollectSymbols(Object* obj) {
+        while (Is<Cell>(obj)) {
+            CollectSymbols(As<Cell>(obj)->GetFirst());
+            obj = As<Cell>(obj)->GetSecond();
+        }
+        if (Is<Symbol>(obj)) {
+            bound_.insert(Get<Symbol>(obj));
+        }
+    }
+
+    Object** Resolve(Object* obj) {
+        if (!Is<Symbol>(obj) || bound_.contains(Get<Symbol>(obj))) {
+            return nullptr;
+        }
+        return scope_->Find(As<Symbol>(obj));
+    }
+
+    void FoldList(Object* obj) {
+        while (Is<Cell>(obj)) {
+            auto cell = As<Cell>(obj);
+            cell->SetFirst(Fold(cell->GetFirst()));
+            obj = cell->GetSecond();
+        }
+    }
+
+    // Value of a form that is known before it is evaluated: a literal, a folded form or a
+    // reference to a global constant. The bindings the value depends on are added to deps.
+    Object* ConstantValue(Object* obj, std::vector<std::pair<Object**, Object*>>& deps) {
+        if (IsLiteral(obj)) {
+            return obj;
+        }
+        if (Is<FoldedForm>(obj) && IsLiteral(As<FoldedForm>(obj)->GetFolded())) {
+            auto& folded_deps = As<FoldedForm>(obj)->GetDependencies();
+            deps.insert(deps.end(), folded_deps.begin(), folded_deps.end());
+            return As<FoldedForm>(obj)->GetFolded();
+        }
+        if (auto cell = Resolve(obj); cell != nullptr && IsLiteral(*cell)) {
+            deps.emplace_back(cell, *cell);
+            return *cell;
+        }
+        return nullptr;
+    }
+
+    // The bindings, inits and steps of let forms and do, but not the names they bind.
+    void FoldBindings(Object* bindings) {
+        for (; Is<Cell>(bindings); bindings = As<Cell>(bindings)->GetSecond()) {
+            auto binding = As<Cell>(bindings)->GetFirst();
+            if (Is<Cell>(binding)) {
+                FoldList(As<Cell>(binding)->GetSecond());
+            }
+        }
+    }
+
+    // Clauses of cond, (test body ...), and of case, (data body ...), with the data left as
+    // they are.
+    void FoldClauses(Object* clauses, bool data) {
+        for (; Is<Cell>(clauses); clauses = As<Cell>(clauses)->GetSecond()) {
+            auto clause = As<Cell>(clauses)->GetFirst();
+            if (!Is<Cell>(clause)) {
+                continue;
+            }
+            if (!data) {
+                As<Cell>(clause)->SetFirst(Fold(As<Cell>(clause)->GetFirst()));
+            }
+            FoldList(As<Cell>(clause)->GetSecond());
+        }
+    }
+
+    // A symbol stays as it is: the inline cache looks a global up faster than a folded form
+    // checks its dependencies. Only a form that uses its value is folded.
+    Object* Fold(Object* obj) {
+        if (!Is<Cell>(obj)) {
+            return obj;
+        }
+
+        auto cell = As<Cell>(obj);
+        auto func_cell = Resolve(cell->GetFirst());
+        auto func = func_cell == nullptr ? nullptr : *func_cell;
+        auto args = cell->GetSecond();
+
+        // Macro uses are expanded once, here; the expansion may bind names of the use.
+        if (Is<Macro>(func)) {
+            auto expansion = As<Macro>(func)->Expand(obj, scope_);
+            CollectBound(expansion);
+            return Fold(expansion);
+        }
+        if (Is<Quote>(func)) {
+            if (Is<Cell>(args)) {
+                auto datum = As<Cell>(args);
+                datum->SetFirst(scope_->GetConstants().Intern(datum->GetFirst()));
+            }
+            return obj;
+        }
+        // The rest of a binder are expressions; the bindings of the let forms, of a named let and
+        // of do hold expressions after the names, and the exit clause of do is a list of them.
+        if (IsBinder(func)) {
+            if (Is<Let>(func) && Is<Cell>(args) && Is<Symbol>(As<Cell>(args)->GetFirst())) {
+                args = As<Cell>(args)->GetSecond();
+            }
+            if (!Is<Cell>(args)) {
+                return obj;
+            }
+            if (IsAnyOf<Let, LetStar, Letrec, Do>(func)) {
+                FoldBindings(As<Cell>(args)->GetFirst());
+            }
+            auto rest = As<Cell>(args)->GetSecond();
+            if (Is<Do>(func) && Is<Cell>(rest)) {
+                FoldList(As<Cell>(rest)->GetFirst());
+                rest = As<Cell>(rest)->GetSecond();
+            }
+            FoldList(rest);
+            return obj;
+        }
+        if (IsAnyOf<Begin, When, Unless>(func)) {
+            FoldList(args);
+            return obj;
+        }
+        if (Is<Cond>(func)) {
+            FoldClauses(args, false);
+            return obj;
+        }
+        if (Is<Case>(func)) {
+            if (Is<Cell>(args)) {
+                As<Cell>(args)->SetFirst(Fold(As<Cell>(args)->GetFirst()));
+                FoldClauses(As<Cell>(args)->GetSecond(), true);
+            }
+            return obj;
+        }
+        // Arguments of other special forms need not be expressions.
+        if (Is<Functor>(func) && !Is<Procedure>(func) && !IsAnyOf<If, And, Or>(func)) {
+            return obj;
+        }
+        if (!Is<Symbol>(cell->GetFirst())) {
+            cell->SetFirst(Fold(cell->GetFirst()));
+        }
+        FoldList(args);
+        if (!IsListHelper(args)) {
+            return obj;
+        }
+
+        auto vec = ToVector(args);
+        if (Is<If>(func)) {
+            return FoldIf(obj, vec, func_cell);
+        }
+        if (func != nullptr && IsFoldable(func)) {
+            return FoldCall(obj, vec, func_cell);
+        }
+        return obj;
+    }
+
+    Object* FoldIf(Object* obj, std::vector<Object*>& args, Object** func_cell) {
+        if (args.size() < 2 || args.size() > 3) {
+            return obj;
+        }
+        std::vector<std::pair<Object**, Object*>> deps;
+        auto condition = ConstantValue(args.front(), deps);
+        if (condition == nullptr) {
+            return obj;
+        }
+        Object* branch = nullptr;
+        if (ToBool(condition)) {
+            branch = args[1];
+        } else if (args.size() == 3) {
+            branch = args[2];
+        }
+        auto res = Heap::Instance()->Make<FoldedForm>(branch, obj);
+        res->AddDependency(func_cell);
+        res->AddDependencies(deps);
+        return res;
+    }
+
+    Object* FoldCall(Object* obj, std::vector<Object*>& args, Object** func_cell) {
+        std::vector<Object*> values;
+        std::vector<std::pair<Object**, Object*>> deps;
+        for (auto arg : args) {
+            auto value = ConstantValue(arg, deps);
+            if (value == nullptr) {
+                return obj;
+            }
+            values.push_back(value);
+        }
+        if (Is<Divides>(*func_cell)) {
+            for (size_t i = (values.size() == 1 ? 0 : 1); i < values.size(); ++i) {
+                if (IsZero(values[i])) {
+                    return obj;
+                }
+            }
+        }
+
+        Object* value;
+        try {
+            value = As<Procedure>(*func_cell)->Apply(values);
+        } catch (RuntimeError&) {
+            return obj;
+        } catch (SyntaxError&) {
+            return obj;
+        }
+
+        auto res = Heap::Instance()->Make<FoldedForm>(value, obj);
+        res->AddDependency(func_cell);
+        res->AddDependencies(deps);
+        return res;
+    }
+
+    NameSpace* scope_;
+    std::unordered_set<std::string> bound_;
+};
+
+}  // namespace
+
+Object* Optimize(Object* object, NameSpace* scope) {
+    return Optimizer(scope).Run(object);
+}
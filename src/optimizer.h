@@ -0,0 +1,9 @@
+#pragma once
+
+#include "object.h"
+
+// Expands uses of global macros and folds constant arithmetic, comparisons and ifs with
+// literal conditions, also where their operands refer to top-level constants, throughout the
+// bodies of special forms. Folded subforms are replaced with FoldedForm objects, which fall
+// back to the original form once a binding they rely on is redefined.
+Object* Optimize(Object* object, NameSpace* scope);
@@ -25,7 +25,7 @@ Object* Read(Tokenizer* tokenizer) {
     } else if (std::get_if<SymbolToken>(&cur_token)) {
         return storage->Make<Symbol>(std::get<SymbolToken>(cur_token).name);
     } else if (std::get_if<BooleanToken>(&cur_token)) {
-        return storage->Make<Boolean>(std::get<BooleanToken>(cur_token).value);
+        return Boolean::Instance(std::get<BooleanToken>(cur_token).value);
     } else if (std::get_if<ConstantToken>(&cur_token)) {
         return storage->Make<Number>(std::get<ConstantToken>(cur_token).value);
     } else {
@@ -0,0 +1,181 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <iomanip>
+#include "object.h"
+
+namespace {
+
+constexpr size_t kNoName = static_cast<size_t>(-1);
+
+std::string ProfileName(Functor* func) {
+    if (Is<Memoized>(func)) {
+        func = As<Memoized>(func)->GetFunction();
+    }
+    if (Is<Lambda>(func)) {
+        auto& name = As<Lambda>(func)->GetName();
+        return name.empty() ? "[lambda]" : name;
+    }
+    return func->GetFunctorName();
+}
+
+}  // namespace
+
+void Profiler::Start(ProfilerMode mode, std::chrono::microseconds interval) {
+    Stop();
+    Reset();
+    mode_ = mode;
+    if (mode_ == ProfilerMode::SAMPLING) {
+        ticker_stop_ = false;
+        ticker_ = std::thread([this, interval] {
+            std::unique_lock lock(ticker_mutex_);
+            while (!ticker_cv_.wait_for(lock, interval, [this] { return ticker_stop_; })) {
+                sample_pending_ = true;
+            }
+        });
+    }
+    enabled_ = true;
+}
+
+void Profiler::Stop() {
+    enabled_ = false;
+    if (ticker_.joinable()) {
+        {
+            std::lock_guard lock(ticker_mutex_);
+            ticker_stop_ = true;
+        }
+        ticker_cv_.notify_one();
+        ticker_.join();
+    }
+    stack_.clear();
+    std::fill(active_.begin(), active_.end(), 0);
+}
+
+void Profiler::Reset() {
+    entries_.clear();
+    active_.clear();
+    ids_.clear();
+    nodes_ = {Node{kNoName, kNoName}};
+    stack_.clear();
+    sample_pending_ = false;
+}
+
+size_t Profiler::Intern(const std::string& name) {
+    auto [it, inserted] = ids_.emplace(name, entries_.size());
+    if (inserted) {
+        entries_.push_back(Entry{name});
+        active_.push_back(0);
+    }
+    return it->second;
+}
+
+size_t Profiler::Child(size_t node, size_t name) {
+    auto [it, inserted] = nodes_[node].children.emplace(name, nodes_.size());
+    if (inserted) {
+        nodes_.push_back(Node{name, node});
+    }
+    return it->second;
+}
+
+void Profiler::Enter(Functor* func) {
+    Enter(ProfileName(func));
+}
+
+void Profiler::Enter(const std::string& name) {
+    if (mode_ == ProfilerMode::SAMPLING && sample_pending_) {
+        TakeSample();
+    }
+    auto id = Intern(name);
+    ++entries_[id].calls;
+    ++active_[id];
+    auto node = Child(stack_.empty() ? 0 : stack_.back().node, id);
+    Frame frame{node, id, {}, {}};
+    if (mode_ == ProfilerMode::EXACT) {
+        frame.start = std::chrono::steady_clock::now();
+    }
+    stack_.push_back(frame);
+}
+
+void Profiler::Leave() {
+    if (stack_.empty()) {
+        return;
+    }
+    if (mode_ == ProfilerMode::SAMPLING && sample_pending_) {
+        TakeSample();
+    }
+    auto frame = stack_.back();
+    stack_.pop_back();
+    --active_[frame.name];
+    if (mode_ != ProfilerMode::EXACT) {
+        return;
+    }
+
+    auto elapsed = std::chrono::steady_clock::now() - frame.start;
+    auto self = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed - frame.children);
+    nodes_[frame.node].self += self.count();
+    entries_[frame.name].exclusive += self.count();
+    if (active_[frame.name] == 0) {
+        entries_[frame.name].inclusive +=
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    }
+    if (!stack_.empty()) {
+        stack_.back().children += elapsed;
+    }
+}
+
+void Profiler::TakeSample() {
+    sample_pending_ = false;
+    if (stack_.empty()) {
+        return;
+    }
+    ++nodes_[stack_.back().node].self;
+    ++entries_[stack_.back().name].exclusive;
+    for (size_t i = 0; i < stack_.size(); ++i) {
+        auto name = stack_[i].name;
+        bool seen = false;
+        for (size_t j = 0; j < i && !seen; ++j) {
+            seen = stack_[j].name == name;
+        }
+        if (!seen) {
+            ++entries_[name].inclusive;
+        }
+    }
+}
+
+std::vector<Profiler::Entry> Profiler::GetEntries() const {
+    return entries_;
+}
+
+void Profiler::WriteReport(std::ostream& out) const {
+    auto entries = entries_;
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry& a, const Entry& b) { return a.exclusive > b.exclusive; });
+    bool exact = mode_ == ProfilerMode::EXACT;
+    out << std::left << std::setw(32) << "name" << std::right << std::setw(12) << "calls"
+        << std::setw(16) << (exact ? "incl, us" : "incl, samples") << std::setw(16)
+        << (exact ? "excl, us" : "excl, samples") << '\n';
+    for (auto& entry : entries) {
+        auto scale = exact ? 1000 : 1;
+        out << std::left << std::setw(32) << entry.name << std::right << std::setw(12)
+            << entry.calls << std::setw(16) << entry.inclusive / scale << std::setw(16)
+            << entry.exclusive / scale << '\n';
+    }
+}
+
+void Profiler::WriteFolded(std::ostream& out) const {
+    WriteFolded(out, 0, "");
+}
+
+void Profiler::WriteFolded(std::ostream& out, size_t node, const std::string& prefix) const {
+    for (auto [name, child] : nodes_[node].children) {
+        auto path = prefix.empty() ? entries_[name].name : prefix + ";" + entries_[name].name;
+        auto weight = nodes_[child].self;
+        if (mode_ == ProfilerMode::EXACT) {
+            weight /= 1000;
+        }
+        if (weight > 0) {
+            out << path << ' ' << weight << '\n';
+        }
+        WriteFolded(out, child, path);
+    }
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class Functor;
+
+enum class ProfilerMode { EXACT, SAMPLING };
+
+// Records calls of procedures (primitives and lambdas, the latter under their defined name).
+// EXACT mode reads the clock on every call and reports nanoseconds; SAMPLING mode only keeps
+// the call stack and charges a sample to it each time the ticker thread fires, so its
+// numbers are sample counts. When disabled the evaluator only tests IsEnabled().
+class Profiler {
+public:
+    struct Entry {
+        std::string name;
+        uint64_t calls = 0;
+        int64_t inclusive = 0;
+        int64_t exclusive = 0;
+    };
+
+    static Profiler* Instance() {
+        static Profiler instance;
+        return &instance;
+    }
+
+    static bool IsEnabled() {
+        return enabled_;
+    }
+
+    ~Profiler() {
+        Stop();
+    }
+
+    void Start(ProfilerMode mode,
+               std::chrono::microseconds interval = std::chrono::microseconds(1000));
+
+    void Stop();
+
+    void Reset();
+
+    ProfilerMode GetMode() const {
+        return mode_;
+    }
+
+    void Enter(Functor* func);
+
+    void Enter(const std::string& name);
+
+    void Leave();
+
+    std::vector<Entry> GetEntries() const;
+
+    // Human-readable table sorted by exclusive cost.
+    void WriteReport(std::ostream& out) const;
+
+    // One "caller;callee;... weight" line per call path, as consumed by flamegraph.pl.
+    void WriteFolded(std::ostream& out) const;
+
+private:
+    struct Node {
+        Node(size_t name, size_t parent) : name(name), parent(parent) {
+        }
+
+        size_t name;
+        size_t parent;
+        int64_t self = 0;
+        std::unordered_map<size_t, size_t> children;
+    };
+
+    struct Frame {
+        size_t node;
+        size_t name;
+        std::chrono::steady_clock::time_point start;
+        std::chrono::steady_clock::duration children;
+    };
+
+    Profiler() = default;
+
+    size_t Intern(const std::string& name);
+
+    size_t Child(size_t node, size_t name);
+
+    void TakeSample();
+
+    void WriteFolded(std::ostream& out, size_t node, const std::string& prefix) const;
+
+    static inline bool enabled_ = false;
+
+    ProfilerMode mode_ = ProfilerMode::EXACT;
+    std::vector<Entry> entries_;
+    std::vector<size_t> active_;
+    std::unordered_map<std::string, size_t> ids_;
+    std::vector<Node> nodes_ = {Node{static_cast<size_t>(-1), static_cast<size_t>(-1)}};
+    std::vector<Frame> stack_;
+
+    std::atomic<bool> sample_pending_ = false;
+    std::thread ticker_;
+    std::mutex ticker_mutex_;
+    std::condition_variable ticker_cv_;
+    bool ticker_stop_ = false;
+};
+
+// Keeps a profiler frame open for the lifetime of the object.
+class ProfilerScope {
+public:
+    explicit ProfilerScope(Functor* func) {
+        Profiler::Instance()->Enter(func);
+    }
+
+    explicit ProfilerScope(const std::string& name) {
+        Profiler::Instance()->Enter(name);
+    }
+
+    ProfilerScope(const ProfilerScope&) = delete;
+    ProfilerScope& operator=(const ProfilerScope&) = delete;
+
+    ~ProfilerScope() {
+        Profiler::Instance()->Leave();
+    }
+};
@@ -0,0 +1,161 @@
+#include "scheduler.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+// SCHEME_THREADS overrides the number of workers, which defaults to one less than the number
+// of cores: the thread that starts tasks works on them too.
+Scheduler::Scheduler() {
+    size_t count = std::max(1u, std::thread::hardware_concurrency()) - 1;
+    if (const char* threads = std::getenv("SCHEME_THREADS")) {
+        count = std::atoi(threads);
+    }
+    count = std::max<size_t>(count, 1);
+    for (size_t i = 0; i < count; ++i) {
+        workers_.push_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < count; ++i) {
+        threads_.emplace_back([this, i] { WorkerLoop(i); });
+    }
+    started_ = true;
+}
+
+Scheduler::~Scheduler() {
+    {
+        std::lock_guard lock(sleep_mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+}
+
+void Scheduler::RunAll(std::span<const std::function<void()>> tasks) {
+    Group group{tasks.size(), std::vector<std::exception_ptr>(tasks.size())};
+    bool outermost = !Heap::InTask();
+    for (size_t i = tasks.size(); i > 0; --i) {
+        Push(Task{tasks[i - 1], &group, i - 1});
+    }
+    WaitUntil([&group] { return group.pending.load(std::memory_order_acquire) == 0; });
+
+    if (outermost && !HasAsyncWork()) {
+        AdoptBuffers();
+    }
+    for (auto& error : group.errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+void Scheduler::Spawn(std::function<void()> task) {
+    async_pending_.fetch_add(1, std::memory_order_acq_rel);
+    Push(Task{std::move(task), nullptr, 0});
+}
+
+void Scheduler::WaitUntil(const std::function<bool()>& done) {
+    while (!done()) {
+        if (auto task = Take()) {
+            Execute(*task);
+        } else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void Scheduler::Quiesce() {
+    WaitUntil([] { return !HasAsyncWork(); });
+    AdoptBuffers();
+}
+
+void Scheduler::AdoptBuffers() {
+    for (auto& worker : workers_) {
+        Heap::Instance()->Adopt(&worker->buffer);
+    }
+    Heap::Instance()->Adopt(&external_buffer_);
+}
+
+void Scheduler::WorkerLoop(size_t id) {
+    worker_id_ = id;
+    while (true) {
+        if (auto task = Take()) {
+            Execute(*task);
+            continue;
+        }
+        std::unique_lock lock(sleep_mutex_);
+        wake_.wait(lock, [this] { return stop_ || queued_.load() > 0; });
+        if (stop_) {
+            return;
+        }
+    }
+}
+
+void Scheduler::Push(const Task& task) {
+    if (worker_id_ != kNoWorker) {
+        auto& worker = *workers_[worker_id_];
+        std::lock_guard lock(worker.mutex);
+        worker.tasks.push_back(task);
+    } else {
+        std::lock_guard lock(external_mutex_);
+        external_tasks_.push_back(task);
+    }
+    {
+        std::lock_guard lock(sleep_mutex_);
+        ++queued_;
+    }
+    wake_.notify_one();
+}
+
+// Own tasks newest first, then tasks from outside of the pool, then the oldest task of some
+// other worker.
+std::optional<Scheduler::Task> Scheduler::Take() {
+    std::optional<Task> task;
+    if (worker_id_ != kNoWorker) {
+        auto& worker = *workers_[worker_id_];
+        std::lock_guard lock(worker.mutex);
+        if (!worker.tasks.empty()) {
+            task = worker.tasks.back();
+            worker.tasks.pop_back();
+        }
+    }
+    if (!task) {
+        std::lock_guard lock(external_mutex_);
+        if (!external_tasks_.empty()) {
+            task = external_tasks_.front();
+            external_tasks_.pop_front();
+        }
+    }
+    auto start = worker_id_ == kNoWorker ? 0 : worker_id_ + 1;
+    for (size_t i = 0; i < workers_.size() && !task; ++i) {
+        auto& victim = *workers_[(start + i) % workers_.size()];
+        std::lock_guard lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+        }
+    }
+    if (task) {
+        --queued_;
+    }
+    return task;
+}
+
+void Scheduler::Execute(const Task& task) {
+    auto previous = Heap::GetLocalBuffer();
+    Heap::SetLocalBuffer(worker_id_ == kNoWorker ? &external_buffer_
+                                                 : &workers_[worker_id_]->buffer);
+    try {
+        task.func();
+    } catch (...) {
+        if (task.group != nullptr) {
+            task.group->errors[task.index] = std::current_exception();
+        }
+    }
+    Heap::SetLocalBuffer(previous);
+    if (task.group != nullptr) {
+        task.group->pending.fetch_sub(1, std::memory_order_release);
+    } else {
+        async_pending_.fetch_sub(1, std::memory_order_release);
+    }
+}
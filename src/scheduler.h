@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <thread>
+#include <vector>
+#include "object.h"
+
+// Work-stealing thread pool for parallel primitives and futures. Every worker has its own
+// deque: it pushes and pops tasks at the back, idle workers steal from the front of the
+// others. Threads that wait for tasks run queued tasks meanwhile, so tasks may start tasks of
+// their own.
+//
+// Tasks allocate into per-thread buffers (see AllocationBuffer). The heap takes the buffers
+// over once no task is running: when the outermost RunAll returns with no asynchronous tasks
+// left, or in Quiesce. The collector must not run before that.
+
+class Scheduler {
+public:
+    static Scheduler* Instance() {
+        static Scheduler instance;
+        return &instance;
+    }
+
+    ~Scheduler();
+
+    // Runs every task and returns once all of them finished. If tasks throw, the exception of
+    // the first of them in order is rethrown.
+    void RunAll(std::span<const std::function<void()>> tasks);
+
+    // Starts an asynchronous task. It must handle its own exceptions.
+    void Spawn(std::function<void()> task);
+
+    // Runs queued tasks until done returns true.
+    void WaitUntil(const std::function<bool()>& done);
+
+    // Waits for all asynchronous tasks and hands every allocation buffer over to the heap.
+    void Quiesce();
+
+    // Whether asynchronous tasks may be running. The main thread then changes namespaces under
+    // a lock and waits for the tasks before changing pairs.
+    static bool HasAsyncWork() {
+        return async_pending_.load(std::memory_order_acquire) > 0;
+    }
+
+    // Whether the pool has been started, i.e. whether Quiesce has anything to do.
+    static bool IsStarted() {
+        return started_;
+    }
+
+    size_t GetWorkerCount() const {
+        return threads_.size();
+    }
+
+private:
+    struct Group {
+        std::atomic<size_t> pending;
+        std::vector<std::exception_ptr> errors;
+    };
+
+    // Tasks of RunAll belong to a group, asynchronous ones do not.
+    struct Task {
+        std::function<void()> func;
+        Group* group;
+        size_t index;
+    };
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+        AllocationBuffer buffer;
+    };
+
+    static constexpr size_t kNoWorker = static_cast<size_t>(-1);
+
+    Scheduler();
+
+    void WorkerLoop(size_t id);
+
+    void Push(const Task& task);
+
+    std::optional<Task> Take();
+
+    void Execute(const Task& task);
+
+    void AdoptBuffers();
+
+    static inline thread_local size_t worker_id_ = kNoWorker;
+    static inline std::atomic<size_t> async_pending_ = 0;
+    static inline bool started_ = false;
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::thread> threads_;
+
+    // Tasks started by threads outside of the pool, and the buffer they allocate into.
+    std::mutex external_mutex_;
+    std::deque<Task> external_tasks_;
+    AllocationBuffer external_buffer_;
+
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    std::atomic<size_t> queued_ = 0;
+    bool stop_ = false;
+};
@@ -1,13 +1,23 @@
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <optional>
 #include <sstream>
 #include <string>
+#include <unordered_set>
+#include <vector>
+#include "code_cache.h"
 #include "error.h"
+#include "image.h"
 #include "object.h"
+#include "optimizer.h"
 #include "parser.h"
+#include "scheduler.h"
 #include "scheme.h"
 
 Object* Copy(Object* object) {
-    if (object == nullptr) {
-        return nullptr;
+    if (object == nullptr || object->IsConstant()) {
+        return object;
     }
     return object->Copy();
 }
@@ -20,34 +30,123 @@ Object* Calc(Object* object, NameSpace* scope) {
     } else if (Is<Boolean>(object)) {
         return As<Boolean>(object);
     } else if (Is<Symbol>(object)) {
-        auto res = scope->Get(As<Symbol>(object)->GetName());
+        auto res = scope->Get(As<Symbol>(object));
         return res;
+    } else if (Is<FoldedForm>(object)) {
+        auto folded = As<FoldedForm>(object);
+        if (!folded->IsValid()) {
+            return Calc(folded->GetOriginal(), scope);
+        } else if (folded->GetFolded() == nullptr) {
+            return nullptr;
+        }
+        return Calc(folded->GetFolded(), scope);
     } else if (Is<Cell>(object)) {
         auto func = Calc(As<Cell>(object)->GetFirst(), scope);
         auto args = (As<Cell>(object))->GetSecond();
         if (!Is<Functor>(func)) {
+            if (Is<Macro>(func)) {
+                return Calc(As<Macro>(func)->ExpandInPlace(As<Cell>(object), scope), scope);
+            }
             throw RuntimeError("cant calc this cell");
         }
-        func = func->Copy();
         return (*As<Functor>(func))(args, scope);
+    } else if (Is<Functor>(object)) {
+        // Head of a macro use rewritten by Macro::ExpandInPlace.
+        return object;
     }
     throw RuntimeError("Unknown object");
 }
 
 std::string Interpreter::Run(const std::string& str) {
-    std::stringstream stream;
-    stream << str;
-    Tokenizer tokenizer(&stream);
-    auto object = Read(&tokenizer);
-    if (!tokenizer.IsEnd()) {
-        throw SyntaxError("Unexpected tokens");
+    return Evaluate([&] {
+        std::stringstream stream;
+        stream << str;
+        Tokenizer tokenizer(&stream);
+        auto object = Read(&tokenizer);
+        if (!tokenizer.IsEnd()) {
+            throw SyntaxError("Unexpected tokens");
+        }
+        object = Optimize(object, global_namespace_);
+        return GetString(Calc(object, global_namespace_));
+    });
+}
+
+std::string Interpreter::LoadFile(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw RuntimeError("Can not open " + path);
+    }
+    std::string source((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    std::optional<CodeCache> cache;
+    if (!cache_directory_.empty()) {
+        cache.emplace(cache_directory_);
+    }
+    std::vector<Object*> forms;
+    if (auto cached = cache ? cache->Load(source, global_namespace_) : std::nullopt) {
+        forms = std::move(*cached);
+    } else {
+        std::stringstream stream(source);
+        Tokenizer tokenizer(&stream);
+        while (!tokenizer.IsEnd()) {
+            forms.push_back(Read(&tokenizer));
+        }
+        if (cache) {
+            cache->Store(source, forms);
+        }
+    }
+
+    return Evaluate([&] {
+        std::string answer;
+        for (auto form : forms) {
+            form = Optimize(form, global_namespace_);
+            answer = GetString(Calc(form, global_namespace_));
+        }
+        return answer;
+    });
+}
+
+// A failed evaluation is collected before the limits are lifted: tasks it left running hit the
+// exceeded limit or the cancellation at their next safepoint instead of running on.
+std::string Interpreter::Evaluate(const std::function<std::string()>& body) {
+    auto token = cancellation_;
+    budget_.Start(limits_, token.get());
+    std::string answer;
+    try {
+        answer = body();
+    } catch (...) {
+        CollectGarbage();
+        budget_.Stop();
+        throw;
     }
-    std::string answer = GetString(Calc(object, global_namespace_));
-    Heap::Instance()->RemoveTrash(global_namespace_);
+    CollectGarbage();
+    budget_.Stop();
     return answer;
 }
 
+void Interpreter::SaveImage(const std::string& path) {
+    ::SaveImage(global_namespace_, path);
+}
+
+void Interpreter::LoadImage(const std::string& path) {
+    ::LoadImage(global_namespace_, path);
+}
+
+void Interpreter::CollectGarbage() {
+    if (Scheduler::IsStarted()) {
+        Scheduler::Instance()->Quiesce();
+    }
+    Heap::Instance()->Collect(global_namespace_);
+}
+
 std::string Interpreter::GetString(Object* object) {
+    std::unordered_set<Object*> open;
+    return GetString(object, open);
+}
+
+// open holds the pairs whose printing is in progress; a reference back to one of them is
+// printed as {selfref}.
+std::string Interpreter::GetString(Object* object, std::unordered_set<Object*>& open) {
     if (object == nullptr) {
         return "()";
     } else if (Is<Number>(object)) {
@@ -62,30 +161,44 @@ std::string Interpreter::GetString(Object* object) {
         return As<Symbol>(object)->GetName();
     } else if (Is<Cell>(object)) {
         std::string res = "(";
+        std::vector<Object*> spine;
 
         do {
             Cell* cell = As<Cell>(object);
-            if (cell->GetFirst() == object) {
+            open.insert(cell);
+            spine.push_back(cell);
+            if (open.contains(cell->GetFirst())) {
                 res += "{selfref} ";
             } else {
-                res += Interpreter::GetString(cell->GetFirst()) + " ";
+                res += GetString(cell->GetFirst(), open) + " ";
             }
 
             object = cell->GetSecond();
 
-        } while (Is<Cell>(object) && As<Cell>(object)->GetSecond() != object);
+        } while (Is<Cell>(object) && !open.contains(object));
 
         if (object != nullptr) {
-            if (Is<Cell>(object) && As<Cell>(object)->GetSecond() == object) {
+            if (open.contains(object)) {
                 res += ". {selfref} ";
             } else {
-                res += ". " + Interpreter::GetString(object) + " ";
+                res += ". " + GetString(object, open) + " ";
             }
         }
+        for (auto cell : spine) {
+            open.erase(cell);
+        }
         res.back() = ')';
         return res;
     } else if (Is<Functor>(object)) {
         return As<Functor>(object)->GetFunctorName();
+    } else if (Is<FoldedForm>(object)) {
+        return GetString(As<FoldedForm>(object)->GetOriginal(), open);
+    } else if (Is<Future>(object)) {
+        return "[future]";
+    } else if (Is<Promise>(object)) {
+        return "[promise]";
+    } else if (Is<Macro>(object)) {
+        return "[macro]";
     } else {
         throw RuntimeError("Unknown object");
     }
@@ -1,6 +1,11 @@
 #pragma once
 
+#include <functional>
+#include <memory>
 #include <string>
+#include <unordered_set>
+#include "budget.h"
+#include "constant_pool.h"
 #include "object.h"
 
 #define SCHEME_FUZZING_2_PRINT_REQUESTS
@@ -9,10 +14,25 @@ Object* Copy(Object* object);
 
 Object* Calc(Object* object, NameSpace* scope);
 
+std::vector<Object*> ToVector(Object* obj);
+
+Object* FromVector(std::span<Object*> vec);
+
+bool IsListHelper(Object* obj);
+
+bool ToBool(Object* obj);
+
+// Flags the names the form may bind again in the frame that binds them (internal defines,
+// letrec and names passed to macros), resolving special forms in scope. set! needs no flag:
+// closures share the boxes of the variables they capture.
+// Every form is passed here before it is evaluated, forms of lambda bodies as not top-level.
+void MarkAssigned(Object* form, NameSpace* scope, bool top_level = true);
+
 class Interpreter {
 public:
     Interpreter() : global_namespace_(Heap::Instance()->Make<NameSpace>()) {
-
+        global_namespace_->SetBudget(&budget_);
+        global_namespace_->SetConstants(&constants_);
         global_namespace_->Set("quote", Heap::Instance()->Make<Quote>());
         global_namespace_->Set("pair?", Heap::Instance()->Make<IsPair>());
         global_namespace_->Set("null?", Heap::Instance()->Make<IsNull>());
@@ -23,6 +43,17 @@ public:
         global_namespace_->Set("cdr", Heap::Instance()->Make<Cdr>());
         global_namespace_->Set("list-ref", Heap::Instance()->Make<ListRef>());
         global_namespace_->Set("list-tail", Heap::Instance()->Make<ListTail>());
+        global_namespace_->Set("length", Heap::Instance()->Make<Length>());
+        global_namespace_->Set("append", Heap::Instance()->Make<Append>());
+        global_namespace_->Set("reverse", Heap::Instance()->Make<Reverse>());
+        global_namespace_->Set("map", Heap::Instance()->Make<Map>());
+        global_namespace_->Set("filter", Heap::Instance()->Make<Filter>());
+        global_namespace_->Set("fold-left", Heap::Instance()->Make<FoldLeft>());
+        global_namespace_->Set("fold-right", Heap::Instance()->Make<FoldRight>());
+        global_namespace_->Set("assq", Heap::Instance()->Make<Assq>());
+        global_namespace_->Set("assoc", Heap::Instance()->Make<Assoc>());
+        global_namespace_->Set("member", Heap::Instance()->Make<Member>());
+        global_namespace_->Set("sort", Heap::Instance()->Make<Sort>());
         global_namespace_->Set("=", Heap::Instance()->Make<EqualTo>());
         global_namespace_->Set(">", Heap::Instance()->Make<Greater>());
         global_namespace_->Set("<", Heap::Instance()->Make<Less>());
@@ -46,20 +77,92 @@ public:
         global_namespace_->Set("set!", Heap::Instance()->Make<Set>());
         global_namespace_->Set("set-car!", Heap::Instance()->Make<SetCar>());
         global_namespace_->Set("set-cdr!", Heap::Instance()->Make<SetCdr>());
+        global_namespace_->Set("gc-stats", Heap::Instance()->Make<GcStats>());
+        global_namespace_->Set("memoize", Heap::Instance()->Make<Memoize>());
+        global_namespace_->Set("define-memoized", Heap::Instance()->Make<DefineMemoized>());
+        global_namespace_->Set("par-map", Heap::Instance()->Make<ParMap>());
+        global_namespace_->Set("par-for-each", Heap::Instance()->Make<ParForEach>());
+        global_namespace_->Set("par-reduce", Heap::Instance()->Make<ParReduce>());
+        global_namespace_->Set("future", Heap::Instance()->Make<CreateFuture>());
+        global_namespace_->Set("touch", Heap::Instance()->Make<Touch>());
+        global_namespace_->Set("delay", Heap::Instance()->Make<Delay>());
+        global_namespace_->Set("force", Heap::Instance()->Make<Force>());
+        global_namespace_->Set("make-promise", Heap::Instance()->Make<MakePromise>());
+        global_namespace_->Set("cons-stream", Heap::Instance()->Make<ConsStream>());
+        global_namespace_->Set("stream-car", Heap::Instance()->Make<StreamCar>());
+        global_namespace_->Set("stream-cdr", Heap::Instance()->Make<StreamCdr>());
         global_namespace_->Set("if", Heap::Instance()->Make<If>());
         global_namespace_->Set("lambda", Heap::Instance()->Make<CreateLambda>());
+        global_namespace_->Set("begin", Heap::Instance()->Make<Begin>());
+        global_namespace_->Set("let", Heap::Instance()->Make<Let>());
+        global_namespace_->Set("let*", Heap::Instance()->Make<LetStar>());
+        global_namespace_->Set("letrec", Heap::Instance()->Make<Letrec>());
+        global_namespace_->Set("cond", Heap::Instance()->Make<Cond>());
+        global_namespace_->Set("case", Heap::Instance()->Make<Case>());
+        global_namespace_->Set("when", Heap::Instance()->Make<When>());
+        global_namespace_->Set("unless", Heap::Instance()->Make<Unless>());
+        global_namespace_->Set("do", Heap::Instance()->Make<Do>());
+        global_namespace_->Set("letrec*", Heap::Instance()->Make<Letrec>());
+        global_namespace_->Set("define-syntax", Heap::Instance()->Make<DefineSyntax>());
+        global_namespace_->Set("syntax-rules", Heap::Instance()->Make<SyntaxRules>());
     }
 
     ~Interpreter() {
+        CollectGarbage();
         Heap::Instance()->Clear();
     }
 
     std::string Run(const std::string& str);
 
+    // Limits every following Run and LoadFile; going over one of them throws LimitError.
+    // Whatever the evaluation allocated is collected, and the interpreter stays usable.
+    void SetLimits(const EvalLimits& limits) {
+        limits_ = limits;
+    }
+
+    // Every following Run and LoadFile throws CancelledError soon after token is cancelled from
+    // another thread, leaving the interpreter usable like LimitError does. nullptr removes it.
+    void SetCancellationToken(std::shared_ptr<CancellationToken> token) {
+        cancellation_ = std::move(token);
+    }
+
     std::string GetString(Object* object);
 
+    // Evaluates every form of a source file and returns the value of the last one. With a cache
+    // directory set, parsed files are cached there.
+    std::string LoadFile(const std::string& path);
+
+    void SetCacheDirectory(const std::string& directory) {
+        cache_directory_ = directory;
+    }
+
+    // Saves the global environment, with everything reachable from it, to an image file.
+    void SaveImage(const std::string& path);
+
+    // Loads bindings from an image written by SaveImage, replacing the ones with equal names.
+    void LoadImage(const std::string& path);
+
+    const HeapStats& GetHeapStats() const {
+        return Heap::Instance()->GetStats();
+    }
+
 private:
+    // Runs body under the limits and collects garbage afterwards, also when body throws.
+    std::string Evaluate(const std::function<std::string()>& body);
+
+    // Waits for pending futures, then has the collector thread free everything unreachable
+    // from the global namespace while evaluation goes on.
+    void CollectGarbage();
+
+    std::string GetString(Object* object, std::unordered_set<Object*>& open);
+
     NameSpace* global_namespace_;
+    std::string cache_directory_;
+    EvalLimits limits_;
+    Budget budget_;
+    // Outlives the heap objects that quote its constants, which the destructor frees.
+    ConstantPool constants_;
+    std::shared_ptr<CancellationToken> cancellation_;
 };
 
 template <typename T>
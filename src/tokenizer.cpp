@@ -22,7 +22,18 @@ void Tokenizer::Next() {
     } else if (c == ')') {
         cur_token_ = BracketToken::CLOSE;
     } else if (c == '.') {
-        cur_token_ = DotToken();
+        std::string dots(1, c);
+        while (in_->peek() == '.') {
+            dots += in_->get();
+        }
+        // The ellipsis of syntax-rules is the only symbol made of dots.
+        if (dots == "...") {
+            cur_token_ = SymbolToken(dots);
+        } else if (dots == ".") {
+            cur_token_ = DotToken();
+        } else {
+            throw SyntaxError("Illegal character " + dots);
+        }
     } else if (c == '\'') {
         cur_token_ = QuoteToken();
     } else {
@@ -0,0 +1,231 @@
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../src/profiler.h"
+#include "../src/scheme.h"
+
+// Runs every test case in a fresh Interpreter and prints the ones that fail. A case runs its
+// setup expressions, then compares what its body returns with the expected string.
+
+namespace {
+
+struct Case {
+    std::string name;
+    std::vector<std::string> setup;
+    std::function<std::string(Interpreter&)> body;
+    std::string expected;
+};
+
+Case SchemeCase(const std::string& name, std::vector<std::string> exprs,
+                const std::string& expected) {
+    auto expr = exprs.back();
+    exprs.pop_back();
+    return {name, std::move(exprs), [expr](Interpreter& inter) { return inter.Run(expr); },
+            expected};
+}
+
+// Number of heap allocations made by running expr.
+std::string CountAllocations(Interpreter& inter, const std::string& expr) {
+    auto before = inter.GetHeapStats().allocations;
+    inter.Run(expr);
+    return std::to_string(inter.GetHeapStats().allocations - before);
+}
+
+// Writes source to a file in directory and loads it, returning the entries the code cache
+// made of it.
+std::vector<std::filesystem::path> LoadCached(Interpreter& inter, const std::string& directory,
+                                              const std::string& name, const std::string& source,
+                                              std::string* result) {
+    auto path = std::filesystem::path(directory) / name;
+    std::ofstream(path) << source;
+    *result = inter.LoadFile(path.string());
+    std::vector<std::filesystem::path> entries;
+    for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+        if (entry.path().extension() == ".mkc") {
+            entries.push_back(entry.path());
+        }
+    }
+    return entries;
+}
+
+// Number of folded forms the optimizer made of expr.
+std::string CountFolded(Interpreter& inter, const std::string& expr) {
+    auto kind = static_cast<size_t>(ObjectKind::FOLDED_FORM);
+    auto before = inter.GetHeapStats().allocations_by_kind[kind];
+    inter.Run(expr);
+    return std::to_string(inter.GetHeapStats().allocations_by_kind[kind] - before);
+}
+
+std::vector<Case> Cases() {
+    return {
+        SchemeCase("closures share a variable set! by a macro",
+         {"(begin (define-syntax dec! (syntax-rules () ((_ v) (set! v (- v 1)))))"
+          "       (define (mk) (let ((m 10)) (cons (lambda () (dec! m) m) (lambda () m)))))",
+          "(define d (mk))", "((car d))", "((cdr d))"},
+         "9"),
+        SchemeCase("closures share a variable set! by one of them",
+         {"(define (counter) (let ((n 0)) (cons (lambda () (set! n (+ n 1)) n) (lambda () n))))",
+          "(define c (counter))", "((car c))", "((car c))", "((cdr c))"},
+         "2"),
+        SchemeCase("closure sees a set! in the frame that binds the variable",
+         {"(define (f k) (let ((a k)) (let ((get (lambda () a))) (set! a (* a 2)) (get))))",
+          "(f 21)"},
+         "42"),
+        SchemeCase("do binds the variables afresh on every iteration",
+         {"(define (fs) (do ((i 0 (+ i 1)) (acc '() (cons (lambda () i) acc))) ((= i 3) acc)))",
+          "(map (lambda (f) (f)) (fs))"},
+         "(2 1 0)"),
+        {"binding forms in a hot lambda allocate nothing on the heap",
+         {"(define (f x) (let ((y x)) (let* ((z y) (w z)) (letrec ((v w)) (do ((i 0)) (#t v))))))",
+          "(define (g x) (begin x))",
+          "(define (run h n) (if (= n 0) 0 (begin (h n) (run h (- n 1)))))", "(run f 10)",
+          "(run g 10)"},
+         [](Interpreter& inter) {
+             auto with_lets = std::stoll(CountAllocations(inter, "(run f 1000)"));
+             auto without = std::stoll(CountAllocations(inter, "(run g 1000)"));
+             return std::to_string(with_lets - without);
+         },
+         "0"},
+        SchemeCase("closure keeping the whole chain keeps the frames of let and the call",
+         {"(define (h x) (let ((y 1)) (define z 2) (lambda () (+ x y z))))", "((h 3))"}, "6"),
+        SchemeCase("promise keeps the frame of let",
+         {"(define (p x) (let ((y (* x 2))) (delay (+ x y))))", "(force (p 4))"}, "12"),
+        SchemeCase("named let keeps working after its frame is left",
+         {"(define (mk)"
+          "  (let ((k 2)) (let loop ((i 0)) (if (< i 3) (loop (+ i 1)) (lambda () (* k i))))))",
+          "((mk))"},
+         "6"),
+        SchemeCase("binding of a template does not capture a variable of the use",
+         {"(define-syntax my-or"
+          "  (syntax-rules ()"
+          "    ((_) #f) ((_ e) e) ((_ e r ...) (let ((t e)) (if t t (my-or r ...))))))",
+          "(let ((t 5)) (my-or #f t))"},
+         "5"),
+        SchemeCase("define of a template does not capture a variable of the use",
+         {"(define-syntax def-tmp (syntax-rules () ((_ v) (begin (define tmp v) tmp))))",
+          "(define tmp 1)", "(def-tmp 42)", "tmp"},
+         "1"),
+        SchemeCase("free template names mean what they mean at the definition",
+         {"(define (helper x) (* x 10))",
+          "(define-syntax call-helper (syntax-rules () ((_ v) (if #t (helper v) 0))))",
+          "(let ((helper (lambda (x) 0)) (if list)) (call-helper 4))"},
+         "40"),
+        SchemeCase("local macro sees the scope it was defined in",
+         {"(define (f)"
+          "  (let ((+ -))"
+          "    (define-syntax add (syntax-rules () ((_ a b) (+ a b))))"
+          "    (let ((+ *)) (add 10 3))))",
+          "(f)"},
+         "7"),
+        SchemeCase("set! in a template assigns the variable of the definition",
+         {"(define counter 0)",
+          "(define-syntax bump (syntax-rules () ((_) (set! counter (+ counter 1)))))",
+          "(let ((counter 100)) (bump) counter)", "counter"},
+         "1"),
+        SchemeCase("quoted template data keep their symbols",
+         {"(define-syntax q (syntax-rules () ((_ v) (list 'a '(b v)))))", "(q 7)"},
+         "(a (b 7))"),
+        {"allocation limit counts what the run allocates, not what is live",
+         {"(define (build n acc) (if (= n 0) acc (build (- n 1) (cons n acc))))",
+          "(define big (build 20000 '()))"},
+         [](Interpreter& inter) {
+             inter.SetLimits({.max_allocated_bytes = 100000});
+             auto length = inter.Run("(length big)");
+             try {
+                 inter.Run("(length (build 20000 '()))");
+             } catch (const LimitError& e) {
+                 return length + " " + e.what();
+             }
+             return length;
+         },
+         "20000 Allocation limit exceeded"},
+        {"constants are folded in the bodies of special forms",
+         {"(define k 3)"},
+         [](Interpreter& inter) {
+             auto body = CountFolded(
+                 inter,
+                 "(define (f x)"
+                 "  (begin (let ((a (* 2 k))) (let* ((b a)) (+ b (* 2 3))))"
+                 "         (cond ((< k 2) 1) (else (case x ((1) (- k 1)) (else x))))"
+                 "         (do ((i 0 (+ i (* k 1)))) ((> i (+ 1 1)) (when x (* 3 3))))))");
+             return body + " " + CountFolded(inter, "(define (g) k)");
+         },
+         "7 0"},
+        SchemeCase("folded constants fall back once redefined",
+         {"(define k 3)", "(define (f x) (let ((y (* k 2))) (cond ((> k 3) 0) (else (+ x y)))))",
+          "(f 1)", "(define k 2)", "(f 1)"},
+         "5"),
+        {"procedures called by the list library are profiled",
+         {"(define (sq x) (* x x))", "(define (less a b) (< a b))"},
+         [](Interpreter& inter) {
+             auto profiler = Profiler::Instance();
+             profiler->Reset();
+             profiler->Start(ProfilerMode::EXACT);
+             inter.Run("(map sq (filter (lambda (x) (sq x)) (sort '(3 1 2) less)))");
+             inter.Run("(fold-left + 0 (fold-right cons '() '(1 2)))");
+             profiler->Stop();
+             std::string calls;
+             for (auto name : {"sq", "less", "[lambda]", "[+]", "[cons]"}) {
+                 for (const auto& entry : profiler->GetEntries()) {
+                     if (entry.name == name) {
+                         calls += (calls.empty() ? "" : " ") + std::to_string(entry.calls);
+                     }
+                 }
+             }
+             profiler->Reset();
+             return calls;
+         },
+         "6 3 3 2 2"},
+        {"code cache ignores an entry made of another source",
+         {},
+         [](Interpreter& inter) {
+             // Gives the entry of one source the name of the other, as a hash collision would.
+             auto directory = std::filesystem::temp_directory_path() / "mukar-scheme-cache-test";
+             std::filesystem::remove_all(directory);
+             std::filesystem::create_directories(directory);
+             inter.SetCacheDirectory(directory.string());
+             std::string result;
+             auto first = LoadCached(inter, directory.string(), "a.scm", "(+ 1 2)", &result);
+             auto both = LoadCached(inter, directory.string(), "b.scm", "(* 2 5)", &result);
+             auto other = both.front() == first.front() ? both.back() : both.front();
+             std::filesystem::copy_file(other, first.front(),
+                                        std::filesystem::copy_options::overwrite_existing);
+             LoadCached(inter, directory.string(), "a.scm", "(+ 1 2)", &result);
+             std::filesystem::remove_all(directory);
+             return result;
+         },
+         "3"},
+    };
+}
+
+std::string RunCase(const Case& test) {
+    Interpreter interpreter;
+    for (const auto& expr : test.setup) {
+        interpreter.Run(expr);
+    }
+    return test.body(interpreter);
+}
+
+}  // namespace
+
+int main() {
+    int failed = 0;
+    for (const auto& test : Cases()) {
+        std::string result;
+        try {
+            result = RunCase(test);
+        } catch (const std::exception& e) {
+            result = std::string("exception: ") + e.what();
+        }
+        if (result != test.expected) {
+            ++failed;
+            std::cout << "FAIL " << test.name << ": expected " << test.expected << ", got "
+                      << result << "\n";
+        }
+    }
+    std::cout << Cases().size() - failed << " passed, " << failed << " failed\n";
+    return failed == 0 ? 0 : 1;
+}